@@ -0,0 +1,318 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "Concurrency.h"
+#include "Config.h"
+#include "DataSet.h"
+#include "Gbm.h"
+#include "GbmFun.h"
+#include "Tree.h"
+#include "TreeRegressor.h"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+DEFINE_int32(bench_rows, 1 << 20,
+             "number of rows of the synthetic data set");
+
+DEFINE_int32(bench_byte_features, 24,
+             "number of synthetic features bucketized to BYTE");
+
+DEFINE_int32(bench_short_features, 8,
+             "number of synthetic features bucketized to SHORT");
+
+DEFINE_int32(bench_parse_rows, 1 << 18,
+             "number of text rows parsed by the getRow benchmark");
+
+DEFINE_int32(bench_repeats, 3,
+             "number of times each benchmark is repeated (the best time "
+             "is reported)");
+
+DEFINE_int32(bench_trees, 10,
+             "number of trees of the end to end getModel benchmark");
+
+DEFINE_int32(bench_leaves, 32,
+             "number of leaves per tree");
+
+namespace boosting {
+
+using namespace std;
+
+// Microbenchmarks of the training hot paths on synthetic data: uniform
+// features, BYTE ones (declared weak) and SHORT ones, and a target that
+// depends on a few of them. Reports rows/sec and GB/sec, counting the
+// bytes of input the benchmarked code has to read.
+class Bench {
+ public:
+  Bench() : numRows_(FLAGS_bench_rows),
+            numFeatures_(FLAGS_bench_byte_features
+                         + FLAGS_bench_short_features) {
+    CHECK(numRows_ > 0 && numFeatures_ > 0);
+  }
+
+  void run() {
+    writeConfig();
+    fillRows();
+
+    benchGetRow();
+
+    DataSet ds(cfg_, numRows_, numRows_);
+    for (int i = 0; i < numRows_; i++) {
+      CHECK(ds.addVector(rows_.data() + static_cast<size_t>(i) * numFeatures_,
+                         targets_[i]));
+    }
+    // bucketization only happens once, on the data set it builds
+    const double closeTime = timeOnce([&ds]() { ds.close(); });
+    report("Bucketize (close)", closeTime, numRows_,
+           static_cast<double>(numRows_) * numFeatures_ * sizeof(double));
+
+    benchTrees(ds);
+
+    LeastSquareFun fun;
+    Gbm engine(fun, ds, cfg_);
+    vector<TreeNode<double>*> model;
+    vector<double> fimps(numFeatures_, 0.0);
+    const double gbmTime = timeOnce([&]() {
+        engine.getModel(&model, fimps.data());
+      });
+    report("Gbm::getModel (per tree)", gbmTime / cfg_.getNumTrees(),
+           numRows_, 0.0);
+    for (auto tree : model) {
+      delete tree;
+    }
+  }
+
+ private:
+  template<class Fn>
+  static double timeOnce(Fn fn) {
+    const auto start = chrono::steady_clock::now();
+    fn();
+    return chrono::duration<double>(chrono::steady_clock::now() - start)
+      .count();
+  }
+
+  // best of FLAGS_bench_repeats runs
+  template<class Fn>
+  static double timeBest(Fn fn) {
+    double best = timeOnce(fn);
+    for (int i = 1; i < FLAGS_bench_repeats; i++) {
+      best = min(best, timeOnce(fn));
+    }
+    return best;
+  }
+
+  static void report(const string& name, double seconds, double rows,
+                     double bytes) {
+    printf("%-44s %10.3f ms %12.1f Mrows/s", name.c_str(), seconds * 1e3,
+           rows / seconds * 1e-6);
+    if (bytes > 0.0) {
+      printf(" %8.2f GB/s", bytes / seconds * 1e-9);
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+
+  void writeConfig() {
+    string columns;
+    string byteColumns;
+    for (int fid = 0; fid < numFeatures_; fid++) {
+      const string name = "\"f" + to_string(fid) + "\"";
+      columns += name + ", ";
+      if (fid < FLAGS_bench_byte_features) {
+        byteColumns += (byteColumns.empty() ? "" : ", ") + name;
+      }
+    }
+    const string trainColumns = columns.substr(0, columns.size() - 2);
+
+    char fileName[] = "/tmp/boosting_bench_XXXXXX";
+    const int fd = mkstemp(fileName);
+    CHECK(fd >= 0) << "fail to create a temporary config file";
+    ::close(fd);
+    {
+      ofstream fs(fileName);
+      fs << "{\"num_trees\": " << FLAGS_bench_trees
+         << ", \"num_leaves\": " << FLAGS_bench_leaves
+         << ", \"example_sampling_rate\": 0.5"
+         << ", \"feature_sampling_rate\": 0.8"
+         << ", \"learning_rate\": 0.1"
+         << ", \"all_columns\": [" << columns << "\"target\"]"
+         << ", \"target_column\": \"target\""
+         << ", \"train_columns\": [" << trainColumns << "]"
+         << ", \"weak_columns\": [" << byteColumns << "]"
+         << ", \"delimiter\": \"TAB\"}";
+    }
+    CHECK(cfg_.readConfig(fileName));
+    unlink(fileName);
+  }
+
+  // BYTE features take 200 distinct values, SHORT ones 10000, both well
+  // within the bucket limit of their encoding
+  void fillRows() {
+    mt19937 gen(0);
+    normal_distribution<double> normal;
+    uniform_int_distribution<int> byteValue(0, 199);
+    uniform_int_distribution<int> shortValue(0, 9999);
+    rows_.resize(static_cast<size_t>(numRows_) * numFeatures_);
+    targets_.resize(numRows_);
+    for (int i = 0; i < numRows_; i++) {
+      double* row = rows_.data() + static_cast<size_t>(i) * numFeatures_;
+      for (int fid = 0; fid < numFeatures_; fid++) {
+        row[fid] = (fid < FLAGS_bench_byte_features)
+          ? byteValue(gen) * 0.01 : shortValue(gen) * 1e-4;
+      }
+      targets_[i] = row[0] - 0.5 * row[numFeatures_ - 1]
+        + (row[numFeatures_ / 2] > 0.5) + 0.1 * normal(gen);
+    }
+  }
+
+  void benchGetRow() {
+    const int numLines = min(numRows_, FLAGS_bench_parse_rows);
+    vector<string> lines(numLines);
+    size_t bytes = 0;
+    char buf[32];
+    for (int i = 0; i < numLines; i++) {
+      const double* row = rows_.data() + static_cast<size_t>(i) * numFeatures_;
+      for (int fid = 0; fid < numFeatures_; fid++) {
+        snprintf(buf, sizeof(buf), "%.6g\t", row[fid]);
+        lines[i] += buf;
+      }
+      snprintf(buf, sizeof(buf), "%.6g", targets_[i]);
+      lines[i] += buf;
+      bytes += lines[i].size() + 1;
+    }
+
+    DataSet ds(cfg_, numLines);
+    vector<double> fvec(numFeatures_);
+    double target;
+    const double seconds = timeBest([&]() {
+        for (const auto& line : lines) {
+          CHECK(ds.getRow(line.data(), line.data() + line.size(), &target,
+                          fvec.data()));
+        }
+      });
+    report("DataSet::getRow", seconds, numLines, bytes);
+  }
+
+  void benchTrees(const DataSet& ds) {
+    boost::scoped_array<double> y(new double[numRows_]);
+    for (int i = 0; i < numRows_; i++) {
+      y[i] = targets_[i];
+    }
+    LeastSquareFun fun;
+    TreeRegressor regressor(ds, y, fun, 0);
+    const vector<int>& index =
+      regressor.sampleRows(cfg_.getExampleSamplingRate());
+    const int n = index.size();
+    const int* begin = index.data();
+    const int* end = index.data() + n;
+
+    // one histogram of every feature over the sampled rows
+    for (int encoding : {BYTE, SHORT}) {
+      vector<int> fids;
+      size_t binBytes = 0;
+      for (int fid = 0; fid < numFeatures_; fid++) {
+        if (ds.getFeature(fid).encoding == encoding) {
+          fids.push_back(fid);
+          binBytes = (encoding == BYTE) ? sizeof(uint8_t) : sizeof(uint16_t);
+        }
+      }
+      if (fids.empty()) {
+        continue;
+      }
+      const string name = (encoding == BYTE) ? "BYTE" : "SHORT";
+
+      vector<unique_ptr<TreeRegressor::Histogram>> hists(fids.size());
+      const double buildTime = timeBest([&]() {
+          for (int k = 0; k < fids.size(); k++) {
+            const auto& f = ds.getFeature(fids[k]);
+            hists[k].reset(new TreeRegressor::Histogram(
+                             f.transitions.size() + 1, n, 0.0));
+            regressor.buildFeatureHistogram(fids[k], begin, end, *hists[k]);
+          }
+        });
+      report("TreeRegressor::buildHistogram " + name, buildTime / fids.size(),
+             n, n * (sizeof(int) + sizeof(double) + binBytes));
+
+      // the split search only reads the buckets, so it is run many times
+      // per histogram; rows count buckets here
+      const int numSearches = 100;
+      size_t numBuckets = 0;
+      for (const auto& hist : hists) {
+        numBuckets += hist->num;
+      }
+      int fv;
+      double gain;
+      const double searchTime = timeBest([&]() {
+          for (int r = 0; r < numSearches; r++) {
+            for (const auto& hist : hists) {
+              TreeRegressor::getBestSplitFromHistogram(*hist, &fv, &gain);
+            }
+          }
+        });
+      report("getBestSplitFromHistogram " + name + " (buckets)",
+             searchTime / numSearches, numBuckets,
+             numBuckets * (sizeof(int) + sizeof(double)));
+
+      // split of all the sampled rows at their median bucket, on a fresh
+      // copy of the index each time
+      vector<int> work(n);
+      vector<int> buffer(n);
+      double splitTime = 0.0;
+      for (int k = 0; k < fids.size(); k++) {
+        const auto& f = ds.getFeature(fids[k]);
+        const uint16_t median = f.transitions.size() / 2;
+        splitTime += timeBest([&]() {
+            copy(index.begin(), index.end(), work.begin());
+            if (encoding == BYTE) {
+              split(work.data(), work.data() + n, buffer.data(), f.bbins,
+                    median);
+            } else {
+              split(work.data(), work.data() + n, buffer.data(), f.sbins,
+                    median);
+            }
+          });
+      }
+      report("split<" + name + ">", splitTime / fids.size(), n,
+             n * (2 * sizeof(int) + binBytes));
+    }
+
+    // every row down a tree grown on the data
+    vector<double> fimps(numFeatures_, 0.0);
+    unique_ptr<TreeNode<uint16_t>> tree(
+      regressor.getTree(cfg_.getNumLeaves(), cfg_.getExampleSamplingRate(),
+                        cfg_.getFeatureSamplingRate(), fimps.data()));
+    double sum = 0.0;
+    const double predictTime = timeBest([&]() {
+        for (int eid = 0; eid < numRows_; eid++) {
+          sum += ds.getPrediction(tree.get(), eid);
+        }
+      });
+    report("DataSet::getPrediction", predictTime, numRows_, 0.0);
+    CHECK(sum == sum);
+  }
+
+  const int numRows_;
+  const int numFeatures_;
+  Config cfg_;
+  vector<double> rows_;  // row major
+  vector<double> targets_;
+};
+
+}
+
+int main(int argc, char** argv) {
+  google::SetUsageMessage("Benchmarks of the training hot paths");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  boosting::Concurrency::initThreadPool();
+
+  boosting::Bench bench;
+  bench.run();
+  return 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace boosting {
+
+// Collectives between the processes of a distributed training run, each
+// holding a shard of the rows (see --dist_rank, --dist_size and
+// --dist_master). Rank 0 is the hub: every other rank keeps one TCP
+// connection to it. All ranks must call the collectives in the same order.
+// With a single process, they do nothing.
+class Comm {
+
+ public:
+
+  // connect the ranks
+  static void init();
+
+  static int getRank() {
+    return rank_;
+  }
+
+  static int getSize() {
+    return size_;
+  }
+
+  // Element wise sum of data[0, n) over all ranks, into data on every
+  // rank. Rank 0 adds up the contributions in rank order and sends the
+  // result back, so all ranks end up with the very same values.
+  static void allreduceSum(double* data, size_t n);
+
+  static void allreduceSum(int* data, size_t n);
+
+  // values of rank 0, on every rank
+  static void broadcast(std::vector<double>* values);
+
+  // On rank 0, the values of every rank (of any size) into all, by rank;
+  // the other ranks only send theirs
+  static void gather(const std::vector<double>& values,
+                     std::vector<std::vector<double>>* all);
+
+ private:
+
+  template<class T>
+  static void allreduce(T* data, size_t n);
+
+  static int rank_;
+  static int size_;
+
+  // rank 0: connection to each rank (by rank, -1 for itself);
+  // other ranks: the connection to rank 0
+  static std::vector<int> sockets_;
+};
+
+}
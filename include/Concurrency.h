@@ -1,43 +1,202 @@
 #pragma once
 
 #include <atomic>
-#include "thrift/concurrency/Monitor.h"
-#include "thrift/concurrency/PosixThreadFactory.h"
-#include "thrift/concurrency/ThreadManager.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "gflags/gflags.h"
 
 DECLARE_int32(num_threads);
 
 namespace boosting {
 
-class Concurrency {
+// Persistent pool of worker threads for fork-join loops. The thread calling
+// parallelFor works on the loop as well, so a pool of n workers starts n-1
+// threads. Idle workers spin for a while before blocking, so that the short
+// back to back loops of tree building don't pay for a wakeup each time.
+class ThreadPool {
 
  public:
 
-  static boost::shared_ptr<apache::thrift::concurrency::ThreadManager>
-    threadManager;
+  explicit ThreadPool(int numWorkers);
+
+  ~ThreadPool();
+
+  int getNumWorkers() const {
+    return numWorkers_;
+  }
+
+  // Call fn(b, e) on consecutive chunks [b, e) of [begin, end), each of
+  // (at most) grain elements, handing the chunks out to workers as they
+  // become free; returns once all of them are done. Calls from inside a
+  // loop body run inline on the calling worker.
+  void parallelFor(int begin, int end, int grain,
+                   const std::function<void(int, int)>& fn);
+
+  // index in [0, getNumWorkers()) of the calling worker, 0 for threads
+  // outside of the pool; for indexing per worker state inside a loop body
+  static int getWorkerId();
+
+  // total time workers spent waiting, for new loops or for the other
+  // workers to finish the current one, summed over workers
+  double getIdleSeconds() const {
+    return idleNanos_.load(std::memory_order_relaxed) * 1e-9;
+  }
+
+ private:
+
+  void workerLoop(int workerId);
 
-  static void initThreadManager();
+  void addIdleTime(std::chrono::steady_clock::time_point since) {
+    idleNanos_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - since).count(),
+                         std::memory_order_relaxed);
+  }
 
+  void runChunks();
+
+  const int numWorkers_;
+  std::vector<std::thread> threads_;
+
+  // serializes loops started from different threads
+  std::mutex jobMutex_;
+
+  // the current loop, published by bumping generation_
+  const std::function<void(int, int)>* fn_;
+  int end_;
+  int grain_;
+  std::atomic<int> next_;
+
+  std::atomic<uint64_t> generation_;
+  std::atomic<int> pending_;  // workers that haven't finished the loop yet
+  std::atomic<bool> stop_;
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::condition_variable done_;
+  int numSleeping_;
+
+  std::atomic<int64_t> idleNanos_;
 };
 
-class CounterMonitor {
+// Bounded queue between threads of a pipeline. push blocks while the
+// queue is full, which holds back producers that run ahead of consumers.
+template<class T>
+class BlockingQueue {
 
  public:
 
-  explicit CounterMonitor(int n) : counter_(n) {}
+  explicit BlockingQueue(size_t capacity)
+    : capacity_(capacity), closed_(false) {
+  }
+
+  void push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    notFull_.wait(lock, [this] { return queue_.size() < capacity_; });
+    queue_.push_back(std::move(item));
+    notEmpty_.notify_one();
+  }
+
+  // Block until an item is available; false once the queue is closed and
+  // drained
+  bool pop(T* item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    notEmpty_.wait(lock, [this] { return !queue_.empty() || closed_; });
+    if (queue_.empty()) {
+      return false;
+    }
+    *item = std::move(queue_.front());
+    queue_.pop_front();
+    notFull_.notify_one();
+    return true;
+  }
+
+  // no more items will be pushed
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    notEmpty_.notify_all();
+  }
 
-  void init(int size);
+ private:
 
-  void decrement();
+  const size_t capacity_;
+  std::deque<T> queue_;
+  bool closed_;
 
-  int wait();
+  std::mutex mutex_;
+  std::condition_variable notEmpty_;
+  std::condition_variable notFull_;
+};
 
- private:
+class Concurrency {
+
+ public:
+
+  static std::unique_ptr<ThreadPool> threadPool;
+
+  static void initThreadPool();
+
+  static int getNumWorkers() {
+    return threadPool ? threadPool->getNumWorkers() : 1;
+  }
+
+  static int getWorkerId() {
+    return ThreadPool::getWorkerId();
+  }
+
+  static double getIdleSeconds() {
+    return threadPool ? threadPool->getIdleSeconds() : 0.0;
+  }
+
+  // CPUs of each NUMA node that the process may run on (nodes without
+  // any left out), or a single node with all of them if the topology
+  // isn't available
+  static const std::vector<std::vector<int>>& getNumaNodes();
+
+  // Pin the calling thread to one CPU, picked so that consecutive worker
+  // ids alternate between the nodes
+  static void pinWorker(int workerId);
+
+  // Pin the calling thread to the CPUs of a node
+  static void pinToNode(int node);
+
+  // node that pinWorker pins workerId to
+  static int getWorkerNode(int workerId) {
+    return workerId % getNumaNodes().size();
+  }
+
+  // With --pin_threads, pin the calling thread as worker 0 of the pool
+  // (the others pin themselves when they start) until unpinCaller.
+  // Threads it starts in between would inherit its single CPU: start them
+  // between an unpinCaller and another pinCaller.
+  static void pinCaller();
+
+  // Let the calling thread run on all the CPUs of getNumaNodes again
+  static void unpinCaller();
+
+  // Order the items [0, n) by the node nodeOf gives them: those of node k
+  // end up (in increasing order) in order[offsets[k], offsets[k + 1])
+  static void groupByNode(int n, const std::function<int(int)>& nodeOf,
+                          std::vector<int>* order,
+                          std::vector<int>* offsets);
 
-  apache::thrift::concurrency::Monitor monitor_;
+  // Call fn on every item of order, as grouped by groupByNode: each worker
+  // takes the items of its own node first, then those left on the others.
+  // A plain parallelFor unless the workers are pinned over several nodes.
+  static void parallelForByNode(const std::vector<int>& order,
+                                const std::vector<int>& offsets,
+                                const std::function<void(int)>& fn);
 
-  std::atomic<int> counter_;
+  // runs inline if the pool hasn't been started
+  static void parallelFor(int begin, int end, int grain,
+                          const std::function<void(int, int)>& fn);
 
 };
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <boost/scoped_array.hpp>
 #include <cstdint>
 #include <memory>
@@ -15,9 +16,28 @@ enum FeatureEncoding {
   EMPTY   = 0,
   BYTE    = 1,
   SHORT   = 2,
-  DOUBLE  = 3
+  DOUBLE  = 3,
+  NIBBLE  = 4,  // 4 bits, two examples per byte of bvec
+  SPARSE  = 5   // only the examples not in the default bucket
 };
 
+// bins of a NIBBLE feature, the even example of each byte in its low half
+struct NibbleBins {
+  const uint8_t* data;
+
+  explicit NibbleBins(const uint8_t* d) : data(d) {
+  }
+
+  uint8_t operator[](int eid) const {
+    return (data[eid >> 1] >> ((eid & 1) << 2)) & 0xf;
+  }
+};
+
+// number of bytes holding n NIBBLE bins
+inline size_t getNibbleBytes(size_t n) {
+  return (n + 1) / 2;
+}
+
 // different representation of a single feature vec
 // compressed to byte/short for significant memory saving
 // and much faster splits
@@ -27,12 +47,32 @@ struct FeatureData {
   std::unique_ptr<std::vector<uint8_t>> bvec;
   std::unique_ptr<std::vector<uint16_t>> svec;
   std::unique_ptr<std::vector<double>> fvec;
+  std::unique_ptr<std::vector<uint16_t>> pvec;  // buckets, if preset
+  std::unique_ptr<std::vector<int>> ivec;  // SPARSE examples, ascending
+
+  // the bins read by training, set up by DataSet::close() or load(): they
+  // point either into bvec/svec/ivec or into a memory mapped data cache
+  // file. A SPARSE feature keeps the ids of its numSparse examples not in
+  // defaultBin in sids, and their bins in sbins
+  const uint8_t* bbins;
+  const uint16_t* sbins;
+  const int* sids;
+  int numSparse;
+  uint16_t defaultBin;
+
+  FeatureData()
+    : encoding(DOUBLE), bbins(NULL), sbins(NULL), sids(NULL), numSparse(0),
+      defaultBin(0) {
+  }
 
   void shrink_to_fit() {
-    if (encoding == BYTE) {
+    if (encoding == BYTE || encoding == NIBBLE) {
       bvec->shrink_to_fit();
     } else if (encoding == SHORT) {
       svec->shrink_to_fit();
+    } else if (encoding == SPARSE) {
+      ivec->shrink_to_fit();
+      svec->shrink_to_fit();
     } else if (encoding == DOUBLE) {
       fvec->shrink_to_fit();
     }
@@ -40,6 +80,95 @@ struct FeatureData {
   }
 };
 
+// first position in the sorted [first, last) not less than x, searching
+// forward from first with exponentially growing steps
+inline const int* gallop(const int* first, const int* last, int x) {
+  if (first == last || *first >= x) {
+    return first;
+  }
+  // first[lo] < x
+  size_t lo = 0;
+  size_t hi = 1;
+  while (first + hi < last && first[hi] < x) {
+    lo = hi;
+    hi *= 2;
+  }
+  return std::lower_bound(first + lo + 1, std::min(first + hi + 1, last), x);
+}
+
+// Call fn(eid, bin) for the examples of the sorted [begin, end) that are
+// not in the default bucket of SPARSE feature f, walking the shorter of
+// the two id lists and galloping through the other
+template<class Fn>
+void forEachSparse(const FeatureData& f, const int* begin, const int* end,
+                   Fn fn) {
+  const int* ids = f.sids;
+  const int* idsEnd = f.sids + f.numSparse;
+  if (end - begin <= idsEnd - ids) {
+    const int* pos = ids;
+    for (const int* it = begin; it != end; ++it) {
+      pos = gallop(pos, idsEnd, *it);
+      if (pos == idsEnd) {
+        break;
+      }
+      if (*pos == *it) {
+        fn(*it, f.sbins[pos - ids]);
+      }
+    }
+  } else {
+    const int* pos = begin;
+    for (const int* it = ids; it != idsEnd; ++it) {
+      pos = gallop(pos, end, *it);
+      if (pos == end) {
+        break;
+      }
+      if (*pos == *it) {
+        fn(*it, f.sbins[it - ids]);
+      }
+    }
+  }
+}
+
+// bins of a SPARSE feature, for examples visited in ascending order (as in
+// a split of a sorted range): each one is found by galloping forward from
+// the previous one
+class SparseBins {
+ public:
+  explicit SparseBins(const FeatureData& f)
+    : ids_(f.sids), end_(f.sids + f.numSparse), bins_(f.sbins),
+      defaultBin_(f.defaultBin), pos_(f.sids), last_(-1) {
+  }
+
+  uint16_t operator[](int eid) const {
+    if (eid < last_) {
+      pos_ = ids_;
+    }
+    last_ = eid;
+    pos_ = gallop(pos_, end_, eid);
+    return (pos_ != end_ && *pos_ == eid) ? bins_[pos_ - ids_] : defaultBin_;
+  }
+
+ private:
+  const int* ids_;
+  const int* end_;
+  const uint16_t* bins_;
+  const uint16_t defaultBin_;
+  mutable const int* pos_;
+  mutable int last_;
+};
+
+// Row major copy of the bins of a group of byte sized (NIBBLE or BYTE)
+// features, so that one pass over the examples of a node can build the
+// histograms of all of them, reading each example's y-value once
+struct FeatureGroup {
+  std::vector<int> fids;      // features of the group
+  std::vector<uint8_t> bins;  // bin of fids[j] for eid at eid * size() + j
+
+  int size() const {
+    return fids.size();
+  }
+};
+
 template<class T> class TreeNode;
 
 // in memory representation of raw data read from a list of data
@@ -49,79 +178,178 @@ class DataSet {
  public:
   DataSet(const Config& cfg, int bucketingThresh, int examplesThresh=-1);
 
+  ~DataSet();
+
   bool addVector(const boost::scoped_array<double>& fvec, double target);
 
+  bool addVector(const double* fvec, double target);
+
   bool getRow(const std::string& line,
               double* target,
               boost::scoped_array<double>& fvec,
               double* cmpValue = NULL) const;
 
+  // parse the line in [begin, end) in place, in a single pass
+  bool getRow(const char* begin,
+              const char* end,
+              double* target,
+              double* fvec,
+              double* cmpValue = NULL) const;
+
   int getNumExamples() const {
     return numExamples_;
   }
 
+  // encoding, transitions and bins of feature fid, after bucketization
+  const FeatureData& getFeature(int fid) const {
+    return features_[fid];
+  }
+
+  // bucket of example eid along feature fid, after bucketization
+  uint16_t getBucket(const int fid, const int eid) const {
+    const auto& f = features_[fid];
+    if (f.encoding == NIBBLE) {
+      return NibbleBins(f.bbins)[eid];
+    } else if (f.encoding == BYTE) {
+      return f.bbins[eid];
+    } else if (f.encoding == SHORT) {
+      return f.sbins[eid];
+    } else if (f.encoding == SPARSE) {
+      const int* it = std::lower_bound(f.sids, f.sids + f.numSparse, eid);
+      return (it != f.sids + f.numSparse && *it == eid)
+        ? f.sbins[it - f.sids] : f.defaultBin;
+    } else {
+      CHECK(f.encoding == EMPTY) << "invalid types";
+      return 0;
+    }
+  }
+
   void getFeatureVec(const int eid, boost::scoped_array<uint16_t>& fvec) const {
     for (int i = 0; i < numFeatures_; i++) {
-      if (features_[i].encoding == EMPTY) {
-        fvec[i] = 0;
-      } else if (features_[i].encoding == BYTE) {
-        fvec[i] = (*features_[i].bvec)[eid];
-      } else if (features_[i].encoding == SHORT) {
-        fvec[i] = (*features_[i].svec)[eid];
-      } else {
-        CHECK(false) << "invalid types";
-      }
+      fvec[i] = getBucket(i, eid);
     }
   }
 
   double getPrediction(TreeNode<uint16_t>* tree, int eid) const;
 
+  // bucket boundaries of feature fid, after bucketization
+  const std::vector<double>& getTransitions(int fid) const {
+    return features_[fid].transitions;
+  }
+
+  // Bucketize with these transitions (one vector per feature, e.g. those
+  // of the data set of another shard) instead of finding them from the
+  // examples, so that buckets mean the same everywhere. Call before
+  // adding any example
+  void setTransitions(const std::vector<std::vector<double>>& transitions);
+
+  // Find the transitions over the examples of all the ranks of a
+  // distributed run (see Comm) instead of this shard only, so that buckets
+  // mean the same on every rank while each loads its own. The raw values
+  // are kept until bucketizing, after bucketingThresh
+  // examples or on close(), which is when the ranks send rank 0 a bounded
+  // summary of them (see --shared_bucketing_values). Call before adding
+  // any example
+  void shareTransitions();
+
   void close() {
     bucketize();
     for (int i = 0; i < numFeatures_; i++) {
       auto &f = features_[i];
       f.shrink_to_fit();
+      f.bbins = f.bvec ? f.bvec->data() : NULL;
+      f.sbins = f.svec ? f.svec->data() : NULL;
+      f.sids = f.ivec ? f.ivec->data() : NULL;
+      f.numSparse = f.ivec ? f.ivec->size() : 0;
     }
 
     targets_.shrink_to_fit();
+    buildFeatureGroups();
+    placeFeatures();
   }
 
+  // Write the bucketized data set (after close()) to a binary cache file,
+  // which load() can map back in instead of parsing and bucketizing the
+  // text files again
+  bool save(const std::string& fileName) const;
+
+  // Map a cache file written by save() with the same feature set into an
+  // empty data set, ready for training (no close() needed)
+  bool load(const std::string& fileName);
+
  private:
   void bucketize();
 
+  // set the transitions of every feature from the runs of sorted values
+  // of all the ranks, merged on rank 0 (see shareTransitions)
+  void exchangeTransitions();
+
+  // row major copies of the byte sized features, if --feature_group_size
+  void buildFeatureGroups();
+
+  // spread the bins of the features and groups over the NUMA nodes, if
+  // --numa_place_features
+  void placeFeatures();
+
+  // NUMA node placeFeatures puts the bins of feature fid (or of group g)
+  // on, for the scans to run there
+  int getFeatureNode(int fid) const;
+
+  int getGroupNode(int g) const;
+
   const Config& cfg_;
   const int bucketingThresh_;
   const int examplesThresh_;
 
+  // feature id of each column of a row, -1 for columns not trained on
+  std::vector<int> columnFids_;
+
   //state of data loading process
   bool preBucketing_;
+  bool presetTransitions_;  // by setTransitions()
+  bool sharedTransitions_;  // by shareTransitions()
   int numExamples_;
   int numFeatures_;
 
   boost::scoped_array<FeatureData> features_;
   std::vector<double> targets_;
 
+  std::vector<FeatureGroup> groups_;
+  std::vector<int> groupIds_;     // group of each feature, -1 if none
+  std::vector<int> groupOffsets_;  // position of each feature in its group
+
+  // memory mapped cache file the bins point into, if loaded from one
+  void* mapped_;
+  size_t mappedSize_;
+
   friend class TreeRegressor;
   friend class Gbm;
-  friend class ParallelBestSplit;
 };
 
-// partition subset into left and right, depending
-// on how the values of fvec compare to fv
-template<class T> void split(const std::vector<int>& subset,
-                             std::vector<int>* left,
-                             std::vector<int>* right,
-                             const std::vector<T>& fvec,
-                             uint16_t fv) {
-
-  for (auto id : subset) {
-    if (fvec[id] <= fv) {
-      left->push_back(id);
-    } else {
-      right->push_back(id);
-    }
+// stably partition [begin, end) in place, depending on how the bins of
+// the examples compare to fv: examples no larger than fv come first.
+// buffer must have room for end - begin entries. Return the first example
+// of the right partition. Bins is a pointer to the bins, or NibbleBins
+template<class Bins> int* split(int* begin,
+                                int* end,
+                                int* buffer,
+                                const Bins& bins,
+                                uint16_t fv) {
+
+  int* left = begin;
+  int* right = buffer;
+  for (int* it = begin; it != end; ++it) {
+    const int id = *it;
+    const bool toLeft = (bins[id] <= fv);
+
+    // branch free: write to both sides, advance only one of them
+    *left = id;
+    *right = id;
+    left += toLeft;
+    right += !toLeft;
   }
+  std::copy(buffer, right, left);
+  return left;
 }
 
 }
-
@@ -0,0 +1,274 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "folly/json.h"
+#include "glog/logging.h"
+#include "Tree.h"
+
+namespace boosting {
+
+// Compiled, read only form of a list of regression trees, for evaluation.
+// The nodes of all trees are stored contiguously as structure of arrays
+// (in depth first order, so the left child usually follows its parent),
+// and leaves are encoded in the child offsets as ~(index of the leaf), so
+// evaluating a tree is a tight loop without virtual calls or type checks.
+// The arrays can be saved to a binary model file, and loaded back by
+// mapping the file, which takes no parsing at all.
+template <class T>
+class Forest {
+ public:
+  // empty, to be loaded
+  Forest() {
+    setArrays();
+  }
+
+  explicit Forest(const std::vector<TreeNode<T>*>& models) {
+    for (const auto& m : models) {
+      rootVec_.push_back(addNode(m));
+    }
+    setArrays();
+  }
+
+  // load from the Json written by dumpModel, without building TreeNode's
+  explicit Forest(const folly::dynamic& obj) {
+    const auto& trees = obj["trees"];
+    const int numTrees = trees.size();
+    for (int i = 0; i < numTrees; i++) {
+      rootVec_.push_back(addJson(trees[i]));
+    }
+    setArrays();
+  }
+
+  Forest(const Forest&) = delete;
+  Forest& operator=(const Forest&) = delete;
+
+  ~Forest();
+
+  // Layout of the binary model file, in native byte order:
+  //   magic, version, sizeof(T), # features, # trees, # partition nodes,
+  //   # leaves
+  //   then, each starting at a multiple of 64 bytes: the roots, the
+  //   fids, values, lefts and rights of the partition nodes, and the
+  //   values of the leaves
+  // numFeatures is the length of the feature vectors the forest evaluates
+  bool save(const std::string& fileName, int numFeatures) const;
+
+  // Map a file written by save into an empty forest, for feature vectors
+  // of numFeatures features. The nodes are checked to only point forward,
+  // and to compare features below numFeatures, so that evaluation can't
+  // run off the arrays (or fvec) or loop forever on a damaged file.
+  bool load(const std::string& fileName, int numFeatures);
+
+  int getNumTrees() const {
+    return numTrees_;
+  }
+
+  // Write a standalone C++ source file evaluating the forest: one function
+  // of nested if's per tree, with the thresholds and votes as literals,
+  // and double predict(const double* fvec), the sum over the trees, where
+  // fvec holds the features in the order of the training columns
+  void writeCode(std::ostream& os) const {
+    os << "// Generated from a boosting model, do not edit.\n\n"
+       << "#include <limits>\n\n";
+    for (int tid = 0; tid < numTrees_; tid++) {
+      os << "static double tree" << tid << "(const double* fvec) {\n";
+      writeNodeCode(os, roots_[tid], 1);
+      os << "}\n\n";
+    }
+    os << "double predict(const double* fvec) {\n"
+       << "  double f = 0.0;\n";
+    for (int tid = 0; tid < numTrees_; tid++) {
+      os << "  f += tree" << tid << "(fvec);\n";
+    }
+    os << "  return f;\n"
+       << "}\n";
+  }
+
+  // Add the value of tree tid to scores[r] for each of numRows rows, row r
+  // starting at rows + r * stride. The rows move down the tree together one
+  // level at a time, and rows that already reached a leaf stay put, so the
+  // inner loop is free of branches and can be vectorized (gather and
+  // compare). nodes is scratch space for numRows entries.
+  void addTreeScores(int tid, const T* rows, int numRows, int stride,
+                     double* scores, int* nodes) const {
+    const int root = roots_[tid];
+    for (int r = 0; r < numRows; r++) {
+      nodes[r] = root;
+    }
+
+    for (int d = 0; d < depths_[tid]; d++) {
+      for (int r = 0; r < numRows; r++) {
+        const int node = nodes[r];
+        const int k = (node < 0) ? 0 : node;  // any valid partition node
+        const bool toLeft = (rows[r * stride + fids_[k]] <= values_[k]);
+        const int next = toLeft ? lefts_[k] : rights_[k];
+        nodes[r] = (node < 0) ? node : next;
+      }
+    }
+
+    for (int r = 0; r < numRows; r++) {
+      scores[r] += leafValues_[~nodes[r]];
+    }
+  }
+
+ private:
+  // unmap the file load() mapped, and fail
+  bool unload();
+
+  // point the arrays read by evaluation at the vectors built
+  void setArrays() {
+    numTrees_ = rootVec_.size();
+    numNodes_ = fidVec_.size();
+    numLeaves_ = leafVec_.size();
+    roots_ = rootVec_.data();
+    fids_ = fidVec_.data();
+    values_ = valueVec_.data();
+    lefts_ = leftVec_.data();
+    rights_ = rightVec_.data();
+    leafValues_ = leafVec_.data();
+    setDepths();
+  }
+
+  void setDepths() {
+    depthVec_.resize(numTrees_);
+    for (int tid = 0; tid < numTrees_; tid++) {
+      depthVec_[tid] = getDepth(roots_[tid]);
+    }
+    depths_ = depthVec_.data();
+  }
+
+  // shortest decimal form that reads back as exactly v; infinities and
+  // NaN, which have none, as std::numeric_limits expressions
+  static std::string toLiteral(double v) {
+    if (v != v) {
+      return "std::numeric_limits<double>::quiet_NaN()";
+    }
+    if (v == std::numeric_limits<double>::infinity()
+        || v == -std::numeric_limits<double>::infinity()) {
+      return std::string(v < 0 ? "-" : "")
+        + "std::numeric_limits<double>::infinity()";
+    }
+    char buf[32];
+    for (int precision = 15; ; precision++) {
+      snprintf(buf, sizeof(buf), "%.*g", precision, v);
+      if (precision == 17 || strtod(buf, NULL) == v) {
+        break;
+      }
+    }
+    std::string literal(buf);
+    if (literal.find_first_of(".en") == std::string::npos) {
+      literal += ".0";
+    }
+    return literal;
+  }
+
+  void writeNodeCode(std::ostream& os, int node, int depth) const {
+    const std::string indent(2 * depth, ' ');
+    if (node < 0) {
+      os << indent << "return " << toLiteral(leafValues_[~node]) << ";\n";
+      return;
+    }
+    os << indent << "if (fvec[" << fids_[node] << "] <= "
+       << toLiteral(values_[node]) << ") {\n";
+    writeNodeCode(os, lefts_[node], depth + 1);
+    os << indent << "} else {\n";
+    writeNodeCode(os, rights_[node], depth + 1);
+    os << indent << "}\n";
+  }
+
+  // number of partition nodes on the longest path from node to a leaf
+  int getDepth(int node) const {
+    if (node < 0) {
+      return 0;
+    }
+    return 1 + std::max(getDepth(lefts_[node]), getDepth(rights_[node]));
+  }
+
+  int addLeaf(double v) {
+    leafVec_.push_back(v);
+    return ~static_cast<int>(leafVec_.size() - 1);
+  }
+
+  int addPartition(int fid, T v) {
+    fidVec_.push_back(fid);
+    valueVec_.push_back(v);
+    leftVec_.push_back(0);
+    rightVec_.push_back(0);
+    return fidVec_.size() - 1;
+  }
+
+  int addNode(const TreeNode<T>* rt) {
+    const PartitionNode<T>* pnode = dynamic_cast<const PartitionNode<T>*>(rt);
+    if (pnode == NULL) {
+      const LeafNode<T>* lfnode = dynamic_cast<const LeafNode<T>*>(rt);
+      return addLeaf(lfnode->getVote());
+    }
+
+    const int node = addPartition(pnode->getFid(), pnode->getFv());
+    const int left = addNode(pnode->getLeft());
+    leftVec_[node] = left;
+    const int right = addNode(pnode->getRight());
+    rightVec_[node] = right;
+    return node;
+  }
+
+  // mirrors fromJson in Tree.h
+  int addJson(const folly::dynamic& obj) {
+    int index = obj["index"].asInt();
+
+    T v;
+    if (obj["value"].isInt()) {
+      v = static_cast<T>(obj["value"].asInt());
+    } else {
+      v = static_cast<T>(obj["value"].asDouble());
+    }
+
+    if (index == -1) {
+      return addLeaf(v);
+    }
+
+    const int node = addPartition(index, v);
+    const int left = addJson(obj["left"]);
+    leftVec_[node] = left;
+    const int right = addJson(obj["right"]);
+    rightVec_[node] = right;
+    return node;
+  }
+
+  // the arrays read by evaluation: they point either into the vectors
+  // below, or into a memory mapped model file
+  int numTrees_;
+  int numNodes_;                 // partition nodes
+  int numLeaves_;
+  const int* roots_;             // root of each tree
+  const int* depths_;            // depth of each tree
+
+  // partition nodes
+  const int* fids_;              // feature to compare
+  const T* values_;              // go left if feature <= value
+  const int* lefts_;             // children, ~(leaf index) for leaves
+  const int* rights_;
+
+  const double* leafValues_;
+
+  std::vector<int> rootVec_;
+  std::vector<int> depthVec_;
+  std::vector<int> fidVec_;
+  std::vector<T> valueVec_;
+  std::vector<int> leftVec_;
+  std::vector<int> rightVec_;
+  std::vector<double> leafVec_;
+
+  void* mapped_ = NULL;
+  size_t mappedSize_ = 0;
+};
+
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 
@@ -17,8 +18,16 @@ class Gbm {
       const DataSet& ds,
       const Config& cfg);
 
+  // Append F0 and the trees to model, and their gains to fimps. If
+  // validation is given (bucketized with the transitions of ds, see
+  // DataSet::setTransitions), its scores are updated with each new tree,
+  // and with --early_stopping_rounds training stops once its loss hasn't
+  // improved for that many trees; model and fimps then end at the best one.
+  // With --checkpoint_file, the state is saved every few trees, and a
+  // later run on the same data resumes from it.
   void getModel(std::vector<TreeNode<double>*>* model,
-                double fimps[]);
+                double fimps[],
+                const DataSet* validation = NULL);
 
  private:
 
@@ -11,16 +11,51 @@ namespace boosting {
 // rank), etc.
 class GbmFun {
  public:
-  virtual double getLeafVal(const std::vector<int>& subset,
+  // subset [begin, end) gives the ids of the examples in the leaf
+  virtual double getLeafVal(const int* begin,
+                            const int* end,
                             const boost::scoped_array<double>& y) const = 0;
 
   virtual double getF0(const std::vector<double>& y) const = 0;
 
-  virtual void getGradient(const std::vector<double>& y,
-                           const boost::scoped_array<double>& F,
-                           boost::scoped_array<double>& grad) const = 0;
-
-  virtual double getInitLoss(const std::vector<double>& y) const = 0;
+  // In a distributed run (see Comm) every rank only has a shard of the
+  // examples, so leaf values and F0 are computed from sufficient statistics
+  // of the loss instead, summed over the ranks by the caller: getNumStats()
+  // of them, which addLeafStats and addF0Stats add those of the local
+  // examples to, and which the *FromStats functions turn into the value
+  // once summed.
+  virtual int getNumStats() const = 0;
+
+  virtual void addLeafStats(const int* begin,
+                            const int* end,
+                            const boost::scoped_array<double>& y,
+                            double* stats) const = 0;
+
+  virtual double getLeafValFromStats(const double* stats) const = 0;
+
+  // the examples [begin, end), as a block kernel
+  virtual void addF0Stats(const double* y,
+                          int begin,
+                          int end,
+                          double* stats) const = 0;
+
+  virtual double getF0FromStats(const double* stats) const = 0;
+
+  // Block kernels, called once per range [begin, end) of examples rather
+  // than once per example, so that a pass over the data set can be split
+  // across threads without a virtual call per example.
+  // grad[i] = gradient of the loss of example i at F[i]
+  virtual void getGradient(const double* y,
+                           const double* F,
+                           double* grad,
+                           int begin,
+                           int end) const = 0;
+
+  // sum of the losses of the examples
+  virtual double getLoss(const double* y,
+                         const double* F,
+                         int begin,
+                         int end) const = 0;
 
   virtual double getExampleLoss(const double y, const double f) const = 0;
 
@@ -30,19 +65,61 @@ class GbmFun {
 };
 
 
-class LeastSquareFun : public GbmFun {
+// Block kernels of a loss given by the per example functions
+// Loss::exampleGradient and Loss::exampleLoss, which are inlined into
+// plain loops the compiler can vectorize
+template<class Loss>
+class BlockGbmFun : public GbmFun {
+ public:
+  void getGradient(const double* y,
+                   const double* F,
+                   double* grad,
+                   int begin,
+                   int end) const {
+    for (int i = begin; i < end; i++) {
+      grad[i] = Loss::exampleGradient(y[i], F[i]);
+    }
+  }
+
+  double getLoss(const double* y,
+                 const double* F,
+                 int begin,
+                 int end) const {
+    // independent partial sums, so that the additions can be vectorized
+    // without reordering them
+    const int LANES = 4;
+    double sums[LANES] = {0.0};
+    int i = begin;
+    for (; i + LANES <= end; i += LANES) {
+      for (int k = 0; k < LANES; k++) {
+        sums[k] += Loss::exampleLoss(y[i + k], F[i + k]);
+      }
+    }
+    for (; i < end; i++) {
+      sums[0] += Loss::exampleLoss(y[i], F[i]);
+    }
+    return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+  }
+
+  double getExampleLoss(const double y, const double f) const {
+    return Loss::exampleLoss(y, f);
+  }
+};
+
+class LeastSquareFun : public BlockGbmFun<LeastSquareFun> {
  public:
   LeastSquareFun() : numExamples_(0), sumy_(0.0), sumy2_(0.0), l2_(0.0) {
   }
 
-  double getLeafVal(const std::vector<int>& subset,
+  double getLeafVal(const int* begin,
+                    const int* end,
                     const boost::scoped_array<double>& y) const {
 
     double sum = 0;
-    for (const auto& id : subset) {
-      sum += y[id];
+    for (const int* it = begin; it != end; ++it) {
+      sum += y[*it];
     }
-    return sum/subset.size();
+    return sum/(end - begin);
   }
 
   double getF0(const std::vector<double>& yvec) const {
@@ -53,31 +130,44 @@ class LeastSquareFun : public GbmFun {
     return sum/yvec.size();
   }
 
-  void getGradient(const std::vector<double>& y,
-                   const boost::scoped_array<double>& F,
-                   boost::scoped_array<double>& grad) const {
-
-    int size = y.size();
+  // the sum of the y-values and their number
+  int getNumStats() const {
+    return 2;
+  }
 
-    for (int i = 0; i < size; i++) {
-      grad[i] = y[i] - F[i];
+  void addLeafStats(const int* begin,
+                    const int* end,
+                    const boost::scoped_array<double>& y,
+                    double* stats) const {
+    for (const int* it = begin; it != end; ++it) {
+      stats[0] += y[*it];
     }
+    stats[1] += end - begin;
   }
 
-  double getInitLoss(const std::vector<double>& yvec) const {
-    // Shortcut for computing \sum (y_i - avg(y_i))^2
-    double sumy = 0.0;
-    double sumy2 = 0.0;
+  double getLeafValFromStats(const double* stats) const {
+    return stats[0]/stats[1];
+  }
 
-    for (const auto& y : yvec) {
-      sumy += y;
-      sumy2 += y*y;
+  void addF0Stats(const double* y,
+                  int begin,
+                  int end,
+                  double* stats) const {
+    for (int i = begin; i < end; i++) {
+      stats[0] += y[i];
     }
+    stats[1] += end - begin;
+  }
 
-    return sumy2 - sumy * sumy/yvec.size();
+  double getF0FromStats(const double* stats) const {
+    return stats[0]/stats[1];
   }
 
-  double getExampleLoss(const double y, const double f) const {
+  static double exampleGradient(const double y, const double f) {
+    return y - f;
+  }
+
+  static double exampleLoss(const double y, const double f) {
     return (y - f) * (y - f);
   }
 
@@ -85,17 +175,28 @@ class LeastSquareFun : public GbmFun {
     sumy_ += y;
     numExamples_ += 1;
     sumy2_ += y * y;
-    l2_ += getExampleLoss(y, f);
+    l2_ += exampleLoss(y, f);
   }
 
   double getReduction() const {
     return 1.0 - l2_/(sumy2_ - sumy_ * sumy_/numExamples_);
   }
 
+  // add up the losses accumulated by another instance
+  void merge(const LeastSquareFun& other) {
+    numExamples_ += other.numExamples_;
+    sumy_ += other.sumy_;
+    sumy2_ += other.sumy2_;
+    l2_ += other.l2_;
+  }
+
   int getNumExamples() const {
     return numExamples_;
   }
 
+  // the block kernel, which the accumulated loss below would hide
+  using BlockGbmFun<LeastSquareFun>::getLoss;
+
   double getLoss() const {
     return l2_;
   }
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+
+namespace boosting {
+
+// Counter based pseudo random numbers: a draw is a pure function of its
+// coordinates (seed, tree, node, item), computed by hashing them, so draws
+// can be made from any thread in any order, without shared state, and
+// come out the same no matter how the work is split across threads.
+
+// finalizer of splitmix64, a bijective mixing of the bits of x
+inline uint64_t mixBits(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+inline uint64_t randomBits(uint64_t seed, uint64_t tree,
+                           uint64_t node, uint64_t item) {
+  uint64_t x = mixBits(seed + 0x9e3779b97f4a7c15ULL);
+  x = mixBits(x ^ tree);
+  x = mixBits(x ^ node);
+  return mixBits(x ^ item);
+}
+
+// uniform in [0, 1)
+inline double randomUniform(uint64_t seed, uint64_t tree,
+                            uint64_t node, uint64_t item) {
+  return (randomBits(seed, tree, node, item) >> 11)
+    * (1.0 / 9007199254740992.0);
+}
+
+// Return true with probability probabilityOfTrue
+inline bool biasedCoinFlip(double probabilityOfTrue, uint64_t seed,
+                           uint64_t tree, uint64_t node, uint64_t item) {
+  return randomUniform(seed, tree, node, item) < probabilityOfTrue;
+}
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace boosting {
+
+// Counters of a training run (seconds spent in each phase, rows scanned,
+// memory), kept as totals and per boosting iteration, and written out as a
+// Json stats file. Updates take a lock, so they belong around whole phases
+// or loops, not inside them.
+class Stats {
+
+ public:
+
+  // add value to the named counter, in the totals and in the current
+  // iteration (if any)
+  static void add(const std::string& name, double value);
+
+  // set the named total, e.g. a memory high water mark
+  static void set(const std::string& name, double value);
+
+  // start the counters of the next iteration
+  static void startIteration();
+
+  // peak resident set size of the process so far, in MB
+  static double getPeakRssMb();
+
+  // {"totals": {name: value}, "iterations": [{name: value}]}
+  static bool write(const std::string& fileName);
+
+ private:
+
+  static std::mutex mutex_;
+  static std::map<std::string, double> totals_;
+  static std::vector<std::map<std::string, double>> iterations_;
+};
+
+// adds the seconds between its construction and destruction to a counter
+class ScopedTimer {
+
+ public:
+
+  explicit ScopedTimer(const char* name)
+    : name_(name), start_(std::chrono::steady_clock::now()) {
+  }
+
+  ~ScopedTimer() {
+    Stats::add(name_, std::chrono::duration<double>(
+                 std::chrono::steady_clock::now() - start_).count());
+  }
+
+ private:
+
+  const char* name_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+}
@@ -138,29 +138,4 @@ TreeNode<T>* fromJson(const folly::dynamic& obj) {
   }
 }
 
-template <class T>
-  double predict(const std::vector<TreeNode<T>*>& models,
-                 const boost::scoped_array<T>& fvec) {
-
-  double f = 0.0;
-  for (const auto& m : models) {
-    f += m->eval(fvec);
-  }
-  return f;
-}
-
-template <class T>
-  double predict_vec(const std::vector<TreeNode<T>*>& models,
-                     const boost::scoped_array<T>& fvec,
-                     std::vector<double>* score) {
-
-  double f = 0.0;
-  for (const auto& m : models) {
-    f += m->eval(fvec);
-    score->push_back(f);
-  }
-  return f;
-}
-
-
 }
@@ -1,23 +1,136 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
 #include <vector>
 #include <boost/scoped_array.hpp>
 
 namespace boosting {
 
-inline bool biasedCoinFlip(double p);
-
 class DataSet;
+struct FeatureData;
+struct FeatureGroup;
 template<class T> class TreeNode;
 class GbmFun;
 
 // Build regression trees from DataSet
 class TreeRegressor {
  public:
+  struct Histogram;
+
+ private:
+  struct SplitNode;
+
+  // best split among the features evaluated by one worker
+  struct SplitState {
+    int fid;
+    int fv;
+    double gain;
+
+    SplitState() : fid(0), fv(0), gain(0.0) {
+    }
+
+    void update(int fid, int fv, double gain);
+  };
+
+  // scan of one row block of a node (or of the ranges of index_ of all the
+  // nodes of a level it is scanned for), for one feature or one feature
+  // group
+  struct ScanTask {
+    int node;   // -1 for a level
+    int fid;    // -1 for a group
+    int group;  // -1 for a single feature
+    int block;
+    int numBlocks;
+  };
+
+ public:
+  // Storage that outlives the regressor of a single tree, so that the
+  // next one reuses it instead of allocating: the example index and its
+  // scratch space, the compact rows, the nodes, the working vectors of the
+  // split search and the histogram buffers. For one regressor at a time.
+  struct Scratch {
+    std::vector<int> index;
+    std::vector<int> buffer;
+    std::vector<int> rows;
+    std::vector<FeatureData> compactFeatures;
+    std::vector<FeatureGroup> compactGroups;
+    std::vector<double> compactY;
+    std::vector<float> compactYf;
+
+    std::vector<std::unique_ptr<SplitNode>> nodes;
+
+    // of findBestSplits and findLevelSplits, by node (and by fid)
+    std::vector<std::vector<int>> fids;
+    std::vector<std::vector<int>> scanFids;
+    std::vector<std::vector<std::vector<int>>> groupFids;
+    std::vector<std::vector<int>> scanGroups;
+    std::vector<std::vector<std::vector<std::unique_ptr<Histogram>>>> partials;
+    std::vector<ScanTask> tasks;
+    std::vector<std::pair<int, int>> evals;
+    std::vector<std::pair<int, int>> built;
+    std::vector<std::vector<SplitState>> states;  // by worker
+
+    // of findLevelSplits: the children, the ones scanned and their slots,
+    // by fid the slots scanned for it, and per position in index, the slot
+    // a scan adds it to
+    std::vector<SplitNode*> splits;
+    std::vector<SplitNode*> scans;
+    std::vector<int> slots;
+    std::vector<std::vector<int>> fidSlots;
+    std::vector<int> nodeIds;
+
+    // of findLevelSplits, by fid and then by group: the ranges of index_
+    // scanned for it and their number of rows, and the slots being merged
+    // into them
+    std::vector<std::vector<std::pair<int, int>>> runs;
+    std::vector<long> runRows;
+    std::vector<int> runSlots;
+
+    // by worker, for the scan of a group: the histograms of its features
+    // and their offsets in its rows
+    std::vector<std::vector<Histogram*>> groupHists;
+    std::vector<std::vector<int>> groupOffsets;
+
+    // the tasks of a parallel round grouped by NUMA node, see
+    // Concurrency::groupByNode
+    std::vector<int> taskOrder;
+    std::vector<int> taskOffsets;
+
+    // rows of a leaf, and the statistics summed over the ranks, for its
+    // vote
+    std::vector<int> leafRows;
+    std::vector<double> leafStats;
+
+    // Free histograms by size class (see newHistogram): a list per worker,
+    // refilled in batches from a shared one, which holds sharedBytes
+    std::vector<std::vector<std::vector<std::unique_ptr<Histogram>>>>
+      freeHists;
+    std::vector<std::vector<std::unique_ptr<Histogram>>> sharedHists;
+    size_t sharedBytes;
+    std::mutex sharedMutex;
+
+    // histograms that weren't in the free lists, since the last tree
+    std::atomic<int64_t> numAllocated;
+
+    Scratch();
+    ~Scratch();
+  };
+
+  // treeId picks the random draws (together with FLAGS_seed), so that the
+  // sampling of every tree is reproducible. If yf is given, it is a single
+  // precision copy of y that the histograms are built from (still summed
+  // in double), halving the memory traffic of the scans; leaf votes are
+  // always computed from y. Without scratch, the regressor uses its own.
   TreeRegressor(const DataSet& ds,
                 const boost::scoped_array<double>& y,
-                const GbmFun& fun);
+                const GbmFun& fun,
+                int treeId,
+                const float* yf = NULL,
+                Scratch* scratch = NULL);
 
   // Return the root of a regression tree with desired specifications, based on
   // a random sampling of the data in ds_ and a random sampling of the features.
@@ -29,29 +142,23 @@ class TreeRegressor {
     const double featureSamplingRate,
     double fimps[]);
 
-  ~TreeRegressor();
-
- private:
-
-  // Node in a binary regression tree, computed based on a sampling of the data
-  // (given by subset); responsible for cleaning up subset upon destruction
-  struct SplitNode {
-
-    explicit SplitNode(const std::vector<int>* subset);
+  // After getTree, set leaf[eid] to the number of the leaf that example eid
+  // falls into, for every example in ds_. Sampled examples are read off the
+  // ranges of the leaves; the others are routed down the tree.
+  void getLeafIndex(std::vector<int>* leaf) const;
 
-    const std::vector<int>* subset;  // which subset of the data we're using
-    int fid;        // which feature to split along
-    uint16_t fv;    // value of said feature, at which to split
-    double gain;    // gain in prediction accuracy from this split
-    bool selected;  // internal node of regression tree, as opposed to leaf
+  // Same for the examples [begin, end) of another data set bucketized with
+  // the transitions of ds_ (e.g. the validation one), all routed down the
+  // tree: leaf[eid - begin] for example eid
+  void getLeafIndex(const DataSet& ds, int begin, int end, int* leaf) const;
 
-    SplitNode* left;   // left child in a regression tree
-    SplitNode* right;  // right child in a regression tree
+  // Votes of the leaves of the last tree, in the order they are numbered by
+  // getLeafIndex
+  const std::vector<double>& getLeafVotes() const {
+    return leafVotes_;
+  }
 
-    ~SplitNode() {
-      delete subset;
-    }
-  };
+  ~TreeRegressor();
 
   // More than a histogram in the basic sense of the word, because our
   // data has two dimensions. Make buckets based on the x-dimension,
@@ -59,11 +166,11 @@ class TreeRegressor {
   // observations (as in a basic histogram), but also the sum of y-values
   // of those observations.
   struct Histogram {
-    const int num;             // number of buckets
+    int num;                   // number of buckets
     std::vector<int> cnt;      // number of observations in each bucket
     std::vector<double> sumy;  // sum of y-values of those observations
-    const int totalCnt;
-    const double totalSum;
+    int totalCnt;
+    double totalSum;
 
     Histogram(int n, int cnt, double sum)
     : num(n),
@@ -72,42 +179,306 @@ class TreeRegressor {
       totalCnt(cnt),
       totalSum(sum) {
     }
+
+    // empty n buckets, keeping the capacity of the vectors
+    void reset(int n, int c, double sum) {
+      num = n;
+      cnt.assign(n, 0);
+      sumy.assign(n, 0.0);
+      totalCnt = c;
+      totalSum = sum;
+    }
+
+    // histogram of the examples in parent but not in sibling, i.e. the
+    // other child of parent, computed without touching the examples
+    void setDifference(const Histogram& parent, const Histogram& sibling) {
+      num = parent.num;
+      cnt.resize(num);
+      sumy.resize(num);
+      totalCnt = parent.totalCnt - sibling.totalCnt;
+      totalSum = parent.totalSum - sibling.totalSum;
+
+      for (int i = 0; i < num; i++) {
+        cnt[i] = parent.cnt[i] - sibling.cnt[i];
+        sumy[i] = parent.sumy[i] - sibling.sumy[i];
+      }
+    }
+
+    // put the examples missing from the other buckets into bucket v
+    void fillDefaultBin(int v) {
+      int restCnt = 0;
+      double restSum = 0.0;
+      for (int i = 0; i < num; i++) {
+        restCnt += cnt[i];
+        restSum += sumy[i];
+      }
+      cnt[v] += totalCnt - restCnt;
+      sumy[v] += totalSum - restSum;
+    }
+
+    void add(const Histogram& other) {
+      for (int i = 0; i < num; i++) {
+        cnt[i] += other.cnt[i];
+        sumy[i] += other.sumy[i];
+      }
+    }
+
+    // memory held, which may be more than num buckets once reset
+    size_t getBytes() const {
+      return cnt.capacity() * sizeof(int) + sumy.capacity() * sizeof(double);
+    }
   };
 
-  template<class T>
-    void buildHistogram(const std::vector<int>& subset,
-                        const std::vector<T>& fvec,
-                        Histogram& hist) const;
+  // The kernels of the split search on their own, for the microbenchmarks
+  // (see bench/Bench.cpp): draw the sampling of examples of this tree and
+  // return it, build the histogram of feature fid over the examples in
+  // [begin, end), and choose the x-value such that, by splitting the data
+  // at that value, we minimize the total sum-of-squares error
+  const std::vector<int>& sampleRows(double exampleSamplingRate);
+
+  void buildFeatureHistogram(int fid,
+                             const int* begin,
+                             const int* end,
+                             Histogram& hist) const;
 
-  // Choose the x-value such that, by splitting the data at that value, we
-  // minimize the total sum-of-squares error
   static void getBestSplitFromHistogram(
     const TreeRegressor::Histogram& hist,
     int* idx,
     double* gain);
 
-  // Based on a sampling of the data (given by *subset) and a random sampling
-  // of features (given by featureSamplingRate), find a splitting that maximizes
+ private:
+
+  // Node in a binary regression tree, computed based on a sampling of the data
+  // (given by the range [begin, end) of index_)
+  struct SplitNode {
+
+    SplitNode(int begin, int end);
+
+    // reinitialize for reuse by another node, which keeps the capacity of
+    // hists
+    void reset(int begin, int end);
+
+    int begin;      // which subset of the data we're using,
+    int end;        // as positions in index_
+    int fid;        // which feature to split along
+    uint16_t fv;    // value of said feature, at which to split
+    double gain;    // gain in prediction accuracy from this split
+    bool selected;  // internal node of regression tree, as opposed to leaf
+    int leafIdx;    // number of the leaf, if not selected
+    double totalSum;  // sum of y-values over subset
+
+    // size() and totalSum over the subsets of all the ranks, in a
+    // distributed run (see Comm); the same as those otherwise
+    int globalCnt;
+    double globalSum;
+
+    SplitNode* left;   // left child in a regression tree
+    SplitNode* right;  // right child in a regression tree
+
+    // histograms of the sampled features (indexed by fid, NULL if not
+    // built), kept around so that the larger child can be derived as
+    // parent minus sibling once this node is split
+    std::vector<std::unique_ptr<Histogram>> hists;
+
+    int size() const {
+      return end - begin;
+    }
+  };
+
+  // Bins is a pointer to the bins of the feature, or NibbleBins, and Y
+  // double or float
+  template<class Bins, class Y>
+    void buildHistogram(const int* begin,
+                        const int* end,
+                        const Bins& bins,
+                        const Y* y,
+                        Histogram& hist) const;
+
+  // Build the histogram of feature f over the examples in [begin, end),
+  // which must be sorted, except for the default bucket of a SPARSE one
+  void buildHistogram(const FeatureData& f,
+                      const int* begin,
+                      const int* end,
+                      Histogram& hist) const;
+
+  template<class Y>
+    void buildHistogram(const FeatureData& f,
+                        const int* begin,
+                        const int* end,
+                        const Y* y,
+                        Histogram& hist) const;
+
+  // Build the histograms of the features fids of group over the examples
+  // in [begin, end) in a single pass, into hists (in the order of fids)
+  void buildGroupHistograms(const FeatureGroup& group,
+                            const std::vector<int>& fids,
+                            const int* begin,
+                            const int* end,
+                            const std::vector<Histogram*>& hists) const;
+
+  template<class Y>
+    void buildGroupHistograms(const FeatureGroup& group,
+                              const std::vector<int>& fids,
+                              const int* begin,
+                              const int* end,
+                              const Y* y,
+                              const std::vector<Histogram*>& hists) const;
+
+  // Build the histograms of feature f over the examples at positions
+  // [begin, end) of index_, each one into hists[slot] for the slot its
+  // entry of scratch_.nodeIds gives (skipped if -1), which must be there
+  // unless f is SPARSE. scans are the nodes of the slots.
+  void buildLevelHistograms(const FeatureData& f,
+                            int begin,
+                            int end,
+                            const std::vector<SplitNode*>& scans,
+                            const std::unique_ptr<Histogram>* hists) const;
+
+  template<class Bins, class Y>
+    void buildLevelHistograms(int begin,
+                              int end,
+                              const Bins& bins,
+                              const Y* y,
+                              const std::unique_ptr<Histogram>* hists) const;
+
+  // Same for the features fids of group in a single pass, the histogram of
+  // fid for slot being hists[fid][base + slot] (skipped if NULL)
+  void buildLevelGroupHistograms(
+    const FeatureGroup& group,
+    const std::vector<int>& fids,
+    int begin,
+    int end,
+    const std::vector<std::vector<std::unique_ptr<Histogram>>>& hists,
+    int base) const;
+
+  template<class Y>
+    void buildLevelGroupHistograms(
+      const FeatureGroup& group,
+      const std::vector<int>& fids,
+      int begin,
+      int end,
+      const Y* y,
+      const std::vector<std::vector<std::unique_ptr<Histogram>>>& hists,
+      int base) const;
+
+  // NUMA node of the bins task scans
+  int getTaskNode(const ScanTask& task) const;
+
+  // Histogram of n buckets (and these totals) from the free list of the
+  // calling worker for the size class of n, the buffers of which have room
+  // for the largest n of the class, or a new one if it is empty
+  std::unique_ptr<Histogram> newHistogram(int n, int cnt, double sum) const;
+
+  // Hand the histograms back to the shared free list, as long as it and
+  // the cache fit in FLAGS_histogram_cache_mb; free the others
+  void recycle(std::vector<std::unique_ptr<Histogram>>* hists) const;
+
+  // recycle the histograms of split
+  void releaseHistograms(SplitNode* split);
+
+  // node over [begin, end) of index_, from scratch_.nodes
+  SplitNode* newNode(int begin, int end);
+
+  // Histogram of feature fid over the examples of split: derived from
+  // parent and sibling if both have it, otherwise reduced from the partial
+  // histograms of its row blocks, if any, or else built from scratch
+  std::unique_ptr<Histogram> getHistogram(
+    const SplitNode& split,
+    int fid,
+    const SplitNode* parent,
+    const SplitNode* sibling,
+    const std::vector<std::unique_ptr<Histogram>>& partials) const;
+
+  // Draw the random sampling of features (given by featureSamplingRate)
+  // that both children of the splitIdx-th split (or the root, for 0) are
+  // evaluated on; with FLAGS_sample_features_per_tree, that of the root
+  // for every split
+  std::vector<bool> sampleFeatures(double featureSamplingRate,
+                                   int splitIdx) const;
+
+  // Draw the random sampling of examples of this tree into index_
+  void sampleExamples(double exampleSamplingRate);
+
+  // Gather the bins and y-values of the examples in index_ into compact
+  // rows (see rows_), and point index_, features_, groups_ and rowY_ (or
+  // rowYf_) at them
+  void gatherRows();
+
+  // Based on a sampling of the data (given by [begin, end) of index_) and a
+  // sampling of features (given by sampled), find a splitting that maximizes
   // prediction accuracy, unless terminal==true, in which case just return a
-  // sentry.
+  // sentry. If parent and sibling are given, histograms that both of them
+  // hold are derived by subtraction instead of scanning the examples.
   // Upon finish, also push to working queues (frontiers_ and allSplits_)
-  SplitNode* getBestSplit(const std::vector<int>* subset,
-                          double featureSamplingRate,
+  SplitNode* getBestSplit(int begin,
+                          int end,
+                          const std::vector<bool>& sampled,
+                          const SplitNode* parent,
+                          const SplitNode* sibling,
                           bool terminal);
 
-  // Partition split.subset into left and right according to the splitting
-  // specified by split.fid and split.fv
-  void splitExamples(const SplitNode& split,
-                     std::vector<int>* left,
-                     std::vector<int>* right);
+  // New node over [begin, end) of index_, with the sum of its y-values
+  // (derived from parent and sibling if parent is given, otherwise summed
+  // over the ranks)
+  SplitNode* newSplit(int begin,
+                      int end,
+                      const SplitNode* parent,
+                      const SplitNode* sibling);
 
-  // Return root of a regression tree for data in subset with numSplits internal
+  // getBestSplit for a batch of nodes, each with its own sampling of
+  // features, parent and sibling (or NULL's): the scans of all of them are
+  // done in a single parallel round, and so is the evaluation
+  void findBestSplits(const std::vector<SplitNode*>& splits,
+                      const std::vector<const std::vector<bool>*>& sampled,
+                      const std::vector<const SplitNode*>& parents,
+                      const std::vector<const SplitNode*>& siblings);
+
+  // Best splits of all the children of a level, smallers[i] and largers[i]
+  // being those of a node with histograms parents[i] (or NULL), on the
+  // features sampled[i]. The examples of the children to scan (the smaller
+  // ones, and the larger ones for the features that cannot be derived) are
+  // routed by a per-position node id, in a single pass per feature or
+  // group over the ranges of index_ of the children it is scanned for, all
+  // in one parallel round. Another round finishes and evaluates the
+  // histograms of all the children.
+  void findLevelSplits(const std::vector<SplitNode*>& smallers,
+                       const std::vector<SplitNode*>& largers,
+                       const std::vector<const SplitNode*>& parents,
+                       const std::vector<std::vector<bool>>& sampled);
+
+  // Whether the examples of split left of mid (after splitExamples) are no
+  // more than the others, counted over all the ranks so that every rank
+  // picks the same child to scan
+  bool isLeftSmaller(const SplitNode& split, int mid) const;
+
+  // Sum the freshly built histograms (the others are derived from ones
+  // that already are) of the nodes over the ranks, and set their totals to
+  // those of the nodes
+  void allreduceHistograms(const std::vector<SplitNode*>& splits,
+                           const std::vector<std::pair<int, int>>& built);
+
+  // Drop cached histograms of the frontier nodes least likely to be split
+  // next until the cache fits in FLAGS_histogram_cache_mb
+  void trimHistogramCache();
+
+  // Stably partition the examples of split in index_ according to the
+  // splitting specified by split.fid and split.fv; returns the position of
+  // the first example that goes right
+  int splitExamples(const SplitNode& split);
+
+  // Return root of a regression tree for data in index_ with numSplits internal
   // nodes (i.e., numSplits+1 leaves) by greedily selecting the splits with the
   // biggest gain.
-  SplitNode* getBestSplits(const std::vector<int>* subset,
-                           const int numSplits,
+  SplitNode* getBestSplits(const int numSplits,
                            double featureSamplingRate);
 
+  // Same as getBestSplits, but growing the tree a level at a time: all the
+  // nodes of a level with a gain are split together (as many as the
+  // remaining splits allow, the ones with the most gain first), and their
+  // children are evaluated together by findLevelSplits
+  SplitNode* getBestSplitsByLevel(const int numSplits,
+                                  double featureSamplingRate);
+
   // Recursively construct a tree of ParitionNode's and LeafNode's from
   // a tree of SplitNode's. The point is that SplitNode's carry some working
   // data (e.g., about which data points belong to them) that we should
@@ -117,28 +488,91 @@ class TreeRegressor {
   const DataSet& ds_;
   const boost::scoped_array<double>& y_;
   const GbmFun& fun_;
+  const int treeId_;
+
+  std::unique_ptr<Scratch> ownScratch_;  // if none was given
+  Scratch& scratch_;
+
+  // ids of the examples sampled for the current tree; every node owns a
+  // contiguous range of it, which is partitioned in place as nodes split
+  std::vector<int>& index_;
+
+  // scratch space for the in place partitioning of index_
+  std::vector<int>& buffer_;
+
+  // Where the rows in index_ are read from by the scans: ds_ and y_ (or
+  // yf), or, after gatherRows, dense copies of the sampled examples only,
+  // which index_ then holds positions in (row i being example rows_[i]), so
+  // that scans stream through memory instead of hopping across full
+  // columns. Only one of rowY_ and rowYf_ is set.
+  const FeatureData* features_;
+  const std::vector<FeatureGroup>* groups_;
+  const double* rowY_;
+  const float* rowYf_;
+
+  std::vector<int>& rows_;
+  std::vector<FeatureData>& compactFeatures_;
+  std::vector<FeatureGroup>& compactGroups_;
+  std::vector<double>& compactY_;
+  std::vector<float>& compactYf_;
 
   // working queue to select best numSplits splits
   // could replace with priority queue if necessary
   std::vector<SplitNode*> frontiers_;
 
-  // memory management, to delete SplitNode's upon destruction
-  std::vector<SplitNode*> allSplits_;
+  // number of scratch_.nodes used by the current tree
+  size_t numNodes_;
+
+  // root and leaves of the last tree, and the votes of the latter
+  const SplitNode* root_;
+  std::vector<const SplitNode*> leaves_;
+  std::vector<double> leafVotes_;
+
+  // bytes held by the histograms cached in frontiers_
+  size_t cachedHistBytes_;
 
-  friend class ParallelBestSplit;
+  // seconds spent in splitExamples for this tree, added to the stats once
+  // it is grown rather than on every split
+  double partitionSec_;
 
 };
 
-template<class T>
-  void TreeRegressor::buildHistogram(const std::vector<int>& subset,
-                                     const std::vector<T>& fvec,
+template<class Bins, class Y>
+  void TreeRegressor::buildHistogram(const int* begin,
+                                     const int* end,
+                                     const Bins& bins,
+                                     const Y* y,
                                      Histogram& hist) const {
 
-  for(auto id : subset) {
-    const T& v = fvec[id];
+  for (const int* it = begin; it != end; ++it) {
+    const int id = *it;
+    const int v = bins[id];
+
+    hist.cnt[v] += 1;
+    hist.sumy[v] += y[id];
+  }
+}
+
+template<class Bins, class Y>
+  void TreeRegressor::buildLevelHistograms(
+    int begin,
+    int end,
+    const Bins& bins,
+    const Y* y,
+    const std::unique_ptr<Histogram>* hists) const {
+
+  const int* nodeIds = scratch_.nodeIds.data();
+  for (int pos = begin; pos < end; pos++) {
+    const int slot = nodeIds[pos];
+    if (slot < 0) {
+      continue;
+    }
+    const int id = index_[pos];
+    const int v = bins[id];
 
+    Histogram& hist = *hists[slot];
     hist.cnt[v] += 1;
-    hist.sumy[v] += y_[id];
+    hist.sumy[v] += y[id];
   }
 }
 
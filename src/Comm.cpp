@@ -0,0 +1,199 @@
+#include "Comm.h"
+
+#include <cstdint>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+DEFINE_int32(dist_rank, 0,
+             "rank of this process in a distributed training run");
+
+DEFINE_int32(dist_size, 1,
+             "number of processes of a distributed training run, each "
+             "training on its own shard of the rows (--training_files)");
+
+DEFINE_string(dist_master, "localhost:7070",
+              "host:port rank 0 listens on in a distributed training run");
+
+DEFINE_int32(dist_connect_timeout_sec, 600,
+             "how long other ranks keep trying to connect to rank 0");
+
+namespace boosting {
+
+using namespace std;
+
+int Comm::rank_ = 0;
+int Comm::size_ = 1;
+vector<int> Comm::sockets_;
+
+static void sendAll(int fd, const void* data, size_t bytes) {
+  const char* p = static_cast<const char*>(data);
+  while (bytes > 0) {
+    const ssize_t sent = send(fd, p, bytes, 0);
+    PCHECK(sent > 0) << "fail to send to another rank";
+    p += sent;
+    bytes -= sent;
+  }
+}
+
+static void recvAll(int fd, void* data, size_t bytes) {
+  char* p = static_cast<char*>(data);
+  while (bytes > 0) {
+    const ssize_t received = recv(fd, p, bytes, 0);
+    PCHECK(received > 0) << "fail to receive from another rank";
+    p += received;
+    bytes -= received;
+  }
+}
+
+static void setNoDelay(int fd) {
+  const int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+void Comm::init() {
+  rank_ = FLAGS_dist_rank;
+  size_ = FLAGS_dist_size;
+  CHECK(size_ >= 1 && rank_ >= 0 && rank_ < size_)
+    << "invalid --dist_rank/--dist_size";
+  if (size_ == 1) {
+    return;
+  }
+
+  const size_t colon = FLAGS_dist_master.rfind(':');
+  CHECK(colon != string::npos) << "--dist_master should be host:port";
+  const string host = FLAGS_dist_master.substr(0, colon);
+  const string port = FLAGS_dist_master.substr(colon + 1);
+
+  if (rank_ == 0) {
+    const int listener = socket(AF_INET, SOCK_STREAM, 0);
+    PCHECK(listener >= 0);
+    const int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(atoi(port.c_str()));
+    PCHECK(bind(listener, reinterpret_cast<struct sockaddr*>(&addr),
+                sizeof(addr)) == 0) << "fail to listen on " << port;
+    PCHECK(listen(listener, size_) == 0);
+
+    sockets_.assign(size_, -1);
+    for (int i = 1; i < size_; i++) {
+      const int fd = accept(listener, NULL, NULL);
+      PCHECK(fd >= 0);
+      int32_t rank;
+      recvAll(fd, &rank, sizeof(rank));
+      CHECK(rank > 0 && rank < size_ && sockets_[rank] == -1)
+        << "unexpected rank " << rank;
+      setNoDelay(fd);
+      sockets_[rank] = fd;
+    }
+    ::close(listener);
+  } else {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* info = NULL;
+    CHECK(getaddrinfo(host.c_str(), port.c_str(), &hints, &info) == 0)
+      << "fail to resolve " << FLAGS_dist_master;
+
+    // rank 0 may not be listening yet
+    int fd = -1;
+    for (int i = 0; fd < 0 && i < FLAGS_dist_connect_timeout_sec * 10; i++) {
+      fd = socket(AF_INET, SOCK_STREAM, 0);
+      PCHECK(fd >= 0);
+      if (connect(fd, info->ai_addr, info->ai_addrlen) != 0) {
+        ::close(fd);
+        fd = -1;
+        usleep(100000);
+      }
+    }
+    freeaddrinfo(info);
+    CHECK(fd >= 0) << "fail to connect to " << FLAGS_dist_master;
+
+    const int32_t rank = rank_;
+    sendAll(fd, &rank, sizeof(rank));
+    setNoDelay(fd);
+    sockets_.assign(1, fd);
+  }
+  LOG(INFO) << "rank " << rank_ << " of " << size_ << " connected";
+}
+
+template<class T>
+void Comm::allreduce(T* data, size_t n) {
+  if (size_ == 1 || n == 0) {
+    return;
+  }
+  const size_t bytes = n * sizeof(T);
+  if (rank_ == 0) {
+    vector<T> other(n);
+    for (int rank = 1; rank < size_; rank++) {
+      recvAll(sockets_[rank], other.data(), bytes);
+      for (size_t i = 0; i < n; i++) {
+        data[i] += other[i];
+      }
+    }
+    for (int rank = 1; rank < size_; rank++) {
+      sendAll(sockets_[rank], data, bytes);
+    }
+  } else {
+    sendAll(sockets_[0], data, bytes);
+    recvAll(sockets_[0], data, bytes);
+  }
+}
+
+void Comm::allreduceSum(double* data, size_t n) {
+  allreduce(data, n);
+}
+
+void Comm::allreduceSum(int* data, size_t n) {
+  allreduce(data, n);
+}
+
+void Comm::broadcast(vector<double>* values) {
+  if (size_ == 1) {
+    return;
+  }
+  if (rank_ == 0) {
+    const uint64_t n = values->size();
+    for (int rank = 1; rank < size_; rank++) {
+      sendAll(sockets_[rank], &n, sizeof(n));
+      sendAll(sockets_[rank], values->data(), n * sizeof(double));
+    }
+  } else {
+    uint64_t n;
+    recvAll(sockets_[0], &n, sizeof(n));
+    values->resize(n);
+    recvAll(sockets_[0], values->data(), n * sizeof(double));
+  }
+}
+
+void Comm::gather(const vector<double>& values,
+                  vector<vector<double>>* all) {
+  if (rank_ == 0) {
+    all->assign(size_, vector<double>());
+    (*all)[0] = values;
+    for (int rank = 1; rank < size_; rank++) {
+      uint64_t n;
+      recvAll(sockets_[rank], &n, sizeof(n));
+      (*all)[rank].resize(n);
+      recvAll(sockets_[rank], (*all)[rank].data(), n * sizeof(double));
+    }
+  } else {
+    const uint64_t n = values.size();
+    sendAll(sockets_[0], &n, sizeof(n));
+    sendAll(sockets_[0], values.data(), n * sizeof(double));
+  }
+}
+
+}
@@ -1,38 +1,324 @@
 #include "Concurrency.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <string>
+
+#include "glog/logging.h"
+
 DEFINE_int32(num_threads, 0,
              "number of threads to use in loading & evaluation");
 
-using namespace apache::thrift::concurrency;
+DEFINE_int32(spin_iterations, 1 << 14,
+             "number of times an idle worker polls for new work "
+             "before going to sleep");
+
+DEFINE_bool(pin_threads, false,
+            "pin every pool worker (the calling thread while training) to "
+            "a CPU, alternating between NUMA nodes, so that each keeps its "
+            "caches and memory node across loops, and have workers scan "
+            "the features of their own node first");
 
 namespace boosting {
 
-boost::shared_ptr<ThreadManager>
-  Concurrency::threadManager =
-    boost::shared_ptr<ThreadManager>(NULL);
+using namespace std;
+
+namespace {
+
+thread_local int workerIdx = 0;
+thread_local bool insideLoop = false;
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  this_thread::yield();
+#endif
+}
+
+}
+
+// CPU ids of a sysfs cpulist, e.g. "0-3,8-11"
+static vector<int> parseCpuList(const string& list) {
+  vector<int> cpus;
+  stringstream ss(list);
+  string range;
+  while (getline(ss, range, ',')) {
+    int first, last;
+    const int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+    if (n < 1) {
+      continue;
+    }
+    for (int cpu = first; cpu <= (n == 2 ? last : first); cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+static void setAffinity(const vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (err != 0) {
+    LOG(ERROR) << "fail to set thread affinity: " << err;
+  }
+}
+
+const vector<vector<int>>& Concurrency::getNumaNodes() {
+  static const vector<vector<int>> nodes = [] {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    vector<vector<int>> result;
+    for (int node = 0; ; node++) {
+      ifstream fs("/sys/devices/system/node/node" + to_string(node)
+                  + "/cpulist");
+      string list;
+      if (!getline(fs, list)) {
+        break;
+      }
+      vector<int> cpus;
+      for (int cpu : parseCpuList(list)) {
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+          cpus.push_back(cpu);
+        }
+      }
+      if (!cpus.empty()) {
+        result.push_back(cpus);
+      }
+    }
+    if (result.empty()) {
+      result.emplace_back();
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+          result.back().push_back(cpu);
+        }
+      }
+    }
+    return result;
+  }();
+  return nodes;
+}
+
+void Concurrency::pinWorker(int workerId) {
+  const auto& nodes = getNumaNodes();
+  const auto& cpus = nodes[workerId % nodes.size()];
+  if (!cpus.empty()) {
+    setAffinity({cpus[(workerId / nodes.size()) % cpus.size()]});
+  }
+}
+
+void Concurrency::pinToNode(int node) {
+  const auto& nodes = getNumaNodes();
+  if (!nodes[node].empty()) {
+    setAffinity(nodes[node]);
+  }
+}
+
+void Concurrency::pinCaller() {
+  if (FLAGS_pin_threads) {
+    pinWorker(0);
+  }
+}
 
-void Concurrency::initThreadManager() {
-  if (FLAGS_num_threads > 0) {
-    threadManager = ThreadManager::newSimpleThreadManager(FLAGS_num_threads);
-    threadManager->threadFactory(
-      boost::shared_ptr<ThreadFactory>(
-        new PosixThreadFactory));
-    threadManager->start();
+void Concurrency::unpinCaller() {
+  if (FLAGS_pin_threads) {
+    vector<int> cpus;
+    for (const auto& node : getNumaNodes()) {
+      cpus.insert(cpus.end(), node.begin(), node.end());
+    }
+    setAffinity(cpus);
   }
 }
 
-void CounterMonitor::init(int size) {
-  counter_ = size;
+void Concurrency::groupByNode(int n, const function<int(int)>& nodeOf,
+                              vector<int>* order, vector<int>* offsets) {
+  const int numNodes = getNumaNodes().size();
+  offsets->assign(numNodes + 1, 0);
+  for (int i = 0; i < n; i++) {
+    (*offsets)[nodeOf(i) % numNodes + 1]++;
+  }
+  for (int node = 0; node < numNodes; node++) {
+    (*offsets)[node + 1] += (*offsets)[node];
+  }
+  order->resize(n);
+  for (int i = 0; i < n; i++) {
+    (*order)[(*offsets)[nodeOf(i) % numNodes]++] = i;
+  }
+  // the counts were bumped to the end of each node, shift them back
+  for (int node = numNodes; node > 0; node--) {
+    (*offsets)[node] = (*offsets)[node - 1];
+  }
+  (*offsets)[0] = 0;
 }
 
-void CounterMonitor::decrement() {
-  if (atomic_fetch_sub(&counter_, 1) == 1) {
-    monitor_.notifyAll();
+void Concurrency::parallelForByNode(const vector<int>& order,
+                                    const vector<int>& offsets,
+                                    const function<void(int)>& fn) {
+  const int numNodes = offsets.size() - 1;
+  if (numNodes <= 1 || !FLAGS_pin_threads) {
+    parallelFor(0, order.size(), 1, [&](int b, int e) {
+        for (int i = b; i < e; i++) {
+          fn(order[i]);
+        }
+      });
+    return;
   }
+
+  // one queue per node; every worker runs a single drain of all of them
+  vector<atomic<int>> next(numNodes);
+  for (int node = 0; node < numNodes; node++) {
+    next[node] = offsets[node];
+  }
+  parallelFor(0, getNumWorkers(), 1, [&](int, int) {
+      const int home = getWorkerNode(getWorkerId());
+      for (int k = 0; k < numNodes; k++) {
+        const int node = (home + k) % numNodes;
+        int i;
+        while ((i = next[node].fetch_add(1)) < offsets[node + 1]) {
+          fn(order[i]);
+        }
+      }
+    });
 }
 
-int CounterMonitor::wait() {
-  return monitor_.waitForever();
+unique_ptr<ThreadPool> Concurrency::threadPool;
+
+void Concurrency::initThreadPool() {
+  threadPool.reset(new ThreadPool(std::max(1, FLAGS_num_threads)));
 }
 
-};
+void Concurrency::parallelFor(int begin, int end, int grain,
+                              const function<void(int, int)>& fn) {
+  if (threadPool) {
+    threadPool->parallelFor(begin, end, grain, fn);
+  } else {
+    for (int b = begin; b < end; b += grain) {
+      fn(b, std::min(b + grain, end));
+    }
+  }
+}
+
+ThreadPool::ThreadPool(int numWorkers)
+  : numWorkers_(std::max(1, numWorkers)), fn_(NULL), end_(0), grain_(1),
+    next_(0), generation_(0), pending_(0), stop_(false), numSleeping_(0),
+    idleNanos_(0) {
+
+  for (int wid = 1; wid < numWorkers_; wid++) {
+    threads_.emplace_back(&ThreadPool::workerLoop, this, wid);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    stop_ = true;
+    generation_++;
+  }
+  wakeup_.notify_all();
+  for (auto& t : threads_) {
+    t.join();
+  }
+}
+
+int ThreadPool::getWorkerId() {
+  return workerIdx;
+}
+
+void ThreadPool::runChunks() {
+  insideLoop = true;
+  int b;
+  while ((b = next_.fetch_add(grain_)) < end_) {
+    (*fn_)(b, std::min(b + grain_, end_));
+  }
+  insideLoop = false;
+}
+
+void ThreadPool::workerLoop(int workerId) {
+  workerIdx = workerId;
+  if (FLAGS_pin_threads) {
+    Concurrency::pinWorker(workerId);
+  }
+  uint64_t seen = 0;
+
+  while (true) {
+    const auto idleStart = chrono::steady_clock::now();
+    uint64_t gen = generation_.load(memory_order_acquire);
+    for (int i = 0; gen == seen && i < FLAGS_spin_iterations; i++) {
+      cpuRelax();
+      gen = generation_.load(memory_order_acquire);
+    }
+    if (gen == seen) {
+      unique_lock<mutex> lock(mutex_);
+      numSleeping_++;
+      wakeup_.wait(lock, [this, seen] { return generation_ != seen; });
+      numSleeping_--;
+      gen = generation_;
+    }
+    if (stop_) {
+      return;
+    }
+    seen = gen;
+    addIdleTime(idleStart);
+
+    runChunks();
+
+    if (pending_.fetch_sub(1, memory_order_acq_rel) == 1) {
+      lock_guard<mutex> lock(mutex_);
+      done_.notify_one();
+    }
+  }
+}
+
+void ThreadPool::parallelFor(int begin, int end, int grain,
+                             const function<void(int, int)>& fn) {
+  grain = std::max(1, grain);
+  if (numWorkers_ == 1 || insideLoop || end - begin <= grain) {
+    for (int b = begin; b < end; b += grain) {
+      fn(b, std::min(b + grain, end));
+    }
+    return;
+  }
+
+  lock_guard<mutex> job(jobMutex_);
+
+  fn_ = &fn;
+  end_ = end;
+  grain_ = grain;
+  next_ = begin;
+  pending_ = numWorkers_ - 1;
+
+  bool sleeping;
+  {
+    lock_guard<mutex> lock(mutex_);
+    generation_.fetch_add(1, memory_order_release);
+    sleeping = (numSleeping_ > 0);
+  }
+  if (sleeping) {
+    wakeup_.notify_all();
+  }
+
+  runChunks();
+
+  const auto waitStart = chrono::steady_clock::now();
+  for (int i = 0; pending_.load(memory_order_acquire) > 0
+         && i < FLAGS_spin_iterations; i++) {
+    cpuRelax();
+  }
+  if (pending_.load(memory_order_acquire) > 0) {
+    unique_lock<mutex> lock(mutex_);
+    done_.wait(lock, [this] { return pending_ == 0; });
+  }
+  addIdleTime(waitStart);
+}
+
+}
@@ -1,14 +1,66 @@
 #include "DataSet.h"
 
 #include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <fstream>
 #include <limits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
+#include "Comm.h"
+#include "Concurrency.h"
 #include "Config.h"
+#include "Random.h"
 #include "Tree.h"
 #include "gflags/gflags.h"
 #include "folly/Conv.h"
-#include "folly/String.h"
+
+DECLARE_int32(seed);
+
+DEFINE_string(bucketing_method, "radix",
+              "how to sort feature values to find bucket transitions: "
+              "sort, radix, or sample (radix sort of a random sample of "
+              "bucketing_sample_size values, drawn with --seed, "
+              "approximate)");
+
+DEFINE_int32(bucketing_sample_size, 1 << 20,
+             "number of values per feature searched by the sample "
+             "bucketing method");
+
+DEFINE_double(sparse_threshold, 2.0,
+              "features with at least this fraction of the examples in a "
+              "single bucket are stored sparse: only the other examples "
+              "are kept, with their buckets; above 1 (the default), no "
+              "feature is");
+
+DEFINE_bool(numa_place_features, false,
+            "after bucketization (or mapping the data cache file), move "
+            "the bins of feature (and feature group) i to NUMA node "
+            "i % #nodes, instead of leaving all of them on the node of the "
+            "loading thread (or in the page cache)");
+
+DEFINE_int32(feature_group_size, 0,
+             "if positive, the bins of byte sized features are also kept "
+             "row major, in groups of this many features, to build the "
+             "histograms of large nodes a group at a time (takes one more "
+             "byte per example and grouped feature)");
+
+DEFINE_int32(shared_bucketing_values, 1 << 12,
+             "in a distributed run, the most values per feature each rank "
+             "sends to rank 0 to find the transitions from: its distinct "
+             "values are merged into this many equal weight quantiles. "
+             "Every rank sends up to 16 bytes per value and feature to "
+             "rank 0; 0 sends all the distinct values, which for "
+             "continuous features is 16 bytes per example and feature");
+
+DEFINE_bool(check_bucketing, false,
+            "validate the buckets of every feature after bucketization");
 
 namespace boosting {
 
@@ -17,41 +69,158 @@ using namespace std;
 DataSet::DataSet(const Config& cfg, int bucketingThresh, int examplesThresh)
   : cfg_(cfg), bucketingThresh_(bucketingThresh),
     examplesThresh_(examplesThresh),
-    preBucketing_(true), numExamples_(0),
+    preBucketing_(true), presetTransitions_(false),
+    sharedTransitions_(false), numExamples_(0),
     numFeatures_(cfg.getNumFeatures()),
-    features_(new FeatureData[numFeatures_]) {
+    features_(new FeatureData[numFeatures_]),
+    mapped_(NULL), mappedSize_(0) {
 
   for (int i = 0; i < numFeatures_; i++) {
     features_[i].fvec.reset(new vector<double>());
     features_[i].encoding = DOUBLE;
   }
+
+  columnFids_.resize(cfg.getColumnNames().size(), -1);
+  const auto& trainColumns = cfg.getTrainIdx();
+  for (int fid = 0; fid < trainColumns.size(); fid++) {
+    columnFids_[trainColumns[fid]] = fid;
+  }
+}
+
+DataSet::~DataSet() {
+  if (mapped_ != NULL) {
+    munmap(mapped_, mappedSize_);
+  }
+}
+
+static inline bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+// Parse the number in [begin, end) like atof does. Decimals whose digits
+// fit in 53 bits and whose power of ten is exact as a double are converted
+// exactly with one multiplication or division (Clinger's fast path),
+// anything else falls back to strtod.
+static double parseDouble(const char* begin, const char* end) {
+  static const double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  const uint64_t MAX_MANTISSA = 1ULL << 53;
+
+  const char* p = begin;
+  while (p != end && isspace(static_cast<unsigned char>(*p))) {
+    p++;
+  }
+  bool negative = false;
+  if (p != end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+
+  uint64_t mantissa = 0;
+  int exponent = 0;
+  bool hasDigits = false;
+  for (; p != end && isDigit(*p) && mantissa <= MAX_MANTISSA; p++) {
+    mantissa = mantissa * 10 + (*p - '0');
+    hasDigits = true;
+  }
+  if (p != end && *p == '.') {
+    for (p++; p != end && isDigit(*p) && mantissa <= MAX_MANTISSA; p++) {
+      mantissa = mantissa * 10 + (*p - '0');
+      exponent--;
+      hasDigits = true;
+    }
+  }
+  if (hasDigits && p != end && (*p == 'e' || *p == 'E')) {
+    const char* q = p + 1;
+    bool negativeExp = false;
+    if (q != end && (*q == '-' || *q == '+')) {
+      negativeExp = (*q == '-');
+      q++;
+    }
+    if (q != end && isDigit(*q)) {
+      int e = 0;
+      for (; q != end && isDigit(*q); q++) {
+        e = std::min(e * 10 + (*q - '0'), 10000);
+      }
+      exponent += negativeExp ? -e : e;
+      p = q;
+    }
+  }
+  while (p != end && isspace(static_cast<unsigned char>(*p))) {
+    p++;
+  }
+
+  if (hasDigits && p == end && mantissa <= MAX_MANTISSA
+      && exponent >= -22 && exponent <= 22) {
+    double v = static_cast<double>(mantissa);
+    v = (exponent < 0) ? v / POW10[-exponent] : v * POW10[exponent];
+    return negative ? -v : v;
+  }
+
+  // strtod needs a terminated string
+  char buffer[64];
+  const size_t len = end - begin;
+  if (len < sizeof(buffer)) {
+    memcpy(buffer, begin, len);
+    buffer[len] = '\0';
+    return strtod(buffer, NULL);
+  }
+  return strtod(string(begin, end).c_str(), NULL);
 }
 
 bool DataSet::getRow(const string& line, double* target,
                      boost::scoped_array<double>& fvec,
                      double* cmpValue) const {
-  try {
-    vector<folly::StringPiece> sv;
-    folly::split(cfg_.getDelimiter(), line, sv);
-
-    if (sv.size() != cfg_.getColumnNames().size()) {
-      LOG(ERROR) << "invalid row: unexpected number of columns" << line
-                 << ", expected " << cfg_.getColumnNames().size()
-                 << ", got " << sv.size();
-      return false;
+  return getRow(line.data(), line.data() + line.size(), target, fvec.get(),
+                cmpValue);
+}
+
+bool DataSet::getRow(const char* begin, const char* end, double* target,
+                     double* fvec, double* cmpValue) const {
+  const char delimiter = cfg_.getDelimiter();
+  const int targetIdx = cfg_.getTargetIdx();
+  const int cmpIdx = (cmpValue != NULL) ? cfg_.getCompareIdx() : -1;
+  const int numColumns = columnFids_.size();
+
+  int col = 0;
+  const char* field = begin;
+  while (true) {
+    const char* fieldEnd = static_cast<const char*>(
+      memchr(field, delimiter, end - field));
+    if (fieldEnd == NULL) {
+      fieldEnd = end;
     }
-    const auto& trainColumns = cfg_.getTrainIdx();
 
-    for (int fid = 0; fid < trainColumns.size(); fid++) {
-      fvec[fid] = atof(sv[trainColumns[fid]].toString().c_str());
+    if (col < numColumns) {
+      // columns that aren't used are skipped without conversion
+      const int fid = columnFids_[col];
+      if (fid >= 0 || col == targetIdx || col == cmpIdx) {
+        const double v = parseDouble(field, fieldEnd);
+        if (fid >= 0) {
+          fvec[fid] = v;
+        }
+        if (col == targetIdx) {
+          *target = v;
+        }
+        if (col == cmpIdx) {
+          *cmpValue = v;
+        }
+      }
     }
-    *target = atof(sv[cfg_.getTargetIdx()].toString().c_str());
-    if (cfg_.getCompareIdx() != -1 && cmpValue != NULL) {
-      *cmpValue = atof(sv[cfg_.getCompareIdx()].toString().c_str());
+    col++;
+
+    if (fieldEnd == end) {
+      break;
     }
+    field = fieldEnd + 1;
+  }
 
-  } catch (...) {
-    LOG(ERROR) << "fail to process line: " << line;
+  if (col != numColumns) {
+    LOG(ERROR) << "invalid row: unexpected number of columns"
+               << string(begin, end) << ", expected " << numColumns
+               << ", got " << col;
     return false;
   }
   return true;
@@ -64,13 +233,7 @@ double DataSet::getPrediction(TreeNode<uint16_t>* rt, int eid) const {
     dynamic_cast<const PartitionNode<uint16_t>*>(rt);
 
   if (pnode != NULL) {
-    const int fid = pnode->getFid();
-    uint16_t fv;
-    if (features_[fid].encoding == BYTE) {
-      fv = (*features_[fid].bvec)[eid];
-    } else {
-      fv = (*features_[fid].svec)[eid];
-    }
+    const uint16_t fv = getBucket(pnode->getFid(), eid);
 
     if (fv <= pnode->getFv()) {
       return getPrediction(pnode->getLeft(), eid);
@@ -86,6 +249,10 @@ double DataSet::getPrediction(TreeNode<uint16_t>* rt, int eid) const {
 
 bool DataSet::addVector(const boost::scoped_array<double>& fvec,
                         double target) {
+  return addVector(fvec.get(), target);
+}
+
+bool DataSet::addVector(const double* fvec, double target) {
   if (examplesThresh_ != -1 && numExamples_ > examplesThresh_) {
     return false;
   }
@@ -93,7 +260,14 @@ bool DataSet::addVector(const boost::scoped_array<double>& fvec,
   for (int fid = 0; fid < numFeatures_; fid++) {
     double val = fvec[fid];
     if (preBucketing_) {
-      features_[fid].fvec->push_back(val);
+      if (features_[fid].pvec) {
+        const auto& transitions = features_[fid].transitions;
+        features_[fid].pvec->push_back(
+          lower_bound(transitions.begin(), transitions.end(), val)
+          - transitions.begin());
+      } else {
+        features_[fid].fvec->push_back(val);
+      }
     } else {
       const auto& transitions = features_[fid].transitions;
       const auto& it = lower_bound(transitions.begin(),
@@ -102,12 +276,25 @@ bool DataSet::addVector(const boost::scoped_array<double>& fvec,
 
       if (features_[fid].encoding == EMPTY) {
         continue;
+      } else if (features_[fid].encoding == NIBBLE) {
+        const uint8_t v = it - transitions.begin();
+        if (numExamples_ % 2 == 0) {
+          features_[fid].bvec->push_back(v);
+        } else {
+          features_[fid].bvec->back() |= (v << 4);
+        }
       } else if (features_[fid].encoding == BYTE) {
         (features_[fid].bvec)->push_back(
           static_cast<uint8_t>(it - transitions.begin()));
       } else if (features_[fid].encoding == SHORT) {
         (features_[fid].svec)->push_back(
           static_cast<uint16_t>(it - transitions.begin()));
+      } else if (features_[fid].encoding == SPARSE) {
+        const uint16_t v = it - transitions.begin();
+        if (v != features_[fid].defaultBin) {
+          features_[fid].ivec->push_back(numExamples_);
+          features_[fid].svec->push_back(v);
+        }
       } else {
         LOG(INFO) << "invalid encoding after bucketing";
       }
@@ -123,28 +310,14 @@ bool DataSet::addVector(const boost::scoped_array<double>& fvec,
   return true;
 }
 
-struct IdVal {
-  int id;
-  double val;
-
-  IdVal(int i, double v) : id(i), val(v) {
-  }
-};
-
 template<class T>
-void fillValues(const vector<IdVal>& idvals,
-                const vector<int>& transitions,
+void fillValues(const vector<double>& fvec,
+                const vector<double>& transitions,
                 vector<T>& vec) {
-  int idx = 0;
-  for (int i = 0; i < transitions.size(); i++) {
-    while(idx <= transitions[i]) {
-      vec[idvals[idx].id] = static_cast<T>(i);
-      idx++;
-    }
-  }
-  while (idx < idvals.size()) {
-    vec[idvals[idx].id] = static_cast<T>(transitions.size());
-    idx++;
+  for (int i = 0; i < fvec.size(); i++) {
+    vec[i] = static_cast<T>(lower_bound(transitions.begin(),
+                                        transitions.end(),
+                                        fvec[i]) - transitions.begin());
   }
 }
 
@@ -168,71 +341,390 @@ void check(const vector<T>& vec,
 }
 
 void check(const FeatureData& fd) {
-  if (fd.encoding == BYTE) {
+  if (fd.encoding == SPARSE) {
+    vector<uint16_t> bins(fd.fvec->size(), fd.defaultBin);
+    for (int i = 0; i < fd.ivec->size(); i++) {
+      bins[(*fd.ivec)[i]] = (*fd.svec)[i];
+    }
+    check<uint16_t>(bins, *(fd.fvec), fd.transitions);
+  } else if (fd.encoding == NIBBLE) {
+    vector<uint8_t> bins(fd.fvec->size());
+    for (int i = 0; i < bins.size(); i++) {
+      bins[i] = NibbleBins(fd.bvec->data())[i];
+    }
+    check<uint8_t>(bins, *(fd.fvec), fd.transitions);
+  } else if (fd.encoding == BYTE) {
     check<uint8_t>(*(fd.bvec), *(fd.fvec), fd.transitions);
   } else if (fd.encoding == SHORT) {
     check<uint16_t>(*(fd.svec), *(fd.fvec), fd.transitions);
   }
 }
 
-void Bucketize(FeatureData& fd, bool useByteEncoding) {
-  CHECK(fd.encoding == DOUBLE) << "invalid data to bucketing";
+// LSD radix sort of doubles, on their bits flipped so that they compare
+// as unsigned integers in the same order; skips the bytes all values share
+void radixSort(vector<double>* values) {
+  const size_t num = values->size();
+  if (num == 0) {
+    return;
+  }
+  vector<uint64_t> keys(num);
+  vector<uint64_t> buffer(num);
+  for (size_t i = 0; i < num; i++) {
+    uint64_t bits;
+    memcpy(&bits, &(*values)[i], sizeof(bits));
+    keys[i] = (bits >> 63) ? ~bits : (bits | (1ULL << 63));
+  }
 
-  const auto& fv = *(fd.fvec);
-  const int num = fv.size();
+  for (int shift = 0; shift < 64; shift += 8) {
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < num; i++) {
+      counts[(keys[i] >> shift) & 0xff]++;
+    }
+    if (counts[(keys[0] >> shift) & 0xff] == num) {
+      continue;
+    }
+    size_t offset = 0;
+    for (int b = 0; b < 256; b++) {
+      const size_t count = counts[b];
+      counts[b] = offset;
+      offset += count;
+    }
+    for (size_t i = 0; i < num; i++) {
+      buffer[counts[(keys[i] >> shift) & 0xff]++] = keys[i];
+    }
+    keys.swap(buffer);
+  }
 
-  vector<IdVal> idvals;
-  for (int i = 0; i < num; i++) {
-    idvals.emplace_back(i, fv[i]);
+  for (size_t i = 0; i < num; i++) {
+    const uint64_t key = keys[i];
+    const uint64_t bits = (key >> 63) ? (key & ~(1ULL << 63)) : ~key;
+    memcpy(&(*values)[i], &bits, sizeof(bits));
   }
+}
 
-  sort(idvals.begin(), idvals.end(),
-       [](const IdVal& x, const IdVal& y) {
-         return x.val < y.val;
-       });
+// The values of feature fid transitions are searched in, sorted: all of
+// fv, or only a random sample of them (drawn with replacement, so that
+// sorted or grouped files don't bias it), depending on --bucketing_method
+vector<double> getSortedValues(const vector<double>& fv, int fid) {
+  vector<double> values;
+  if (FLAGS_bucketing_method == "sample"
+      && fv.size() > FLAGS_bucketing_sample_size) {
+    values.reserve(FLAGS_bucketing_sample_size);
+    for (int i = 0; i < FLAGS_bucketing_sample_size; i++) {
+      // drawn outside of any tree (whose ids are non-negative)
+      const uint64_t bits = randomBits(FLAGS_seed, -1, fid, i);
+      values.push_back(fv[bits % fv.size()]);
+    }
+  } else {
+    values = fv;
+  }
 
-  uint16_t maxValue
-    = useByteEncoding ? numeric_limits<uint8_t>::max() : numeric_limits<uint16_t>::max();
+  if (FLAGS_bucketing_method == "sort") {
+    sort(values.begin(), values.end());
+  } else {
+    CHECK(FLAGS_bucketing_method == "radix"
+          || FLAGS_bucketing_method == "sample")
+      << "invalid bucketing method: " << FLAGS_bucketing_method;
+    radixSort(&values);
+  }
+  return values;
+}
+
+// Sorted values, as runs of equal values: runValues[r] is repeated from
+// runEnds[r - 1] to runEnds[r]
+struct SortedRuns {
+  vector<double> runValues;
+  vector<int> runEnds;
+
+  void add(double val, int end) {
+    if (!runValues.empty() && runValues.back() == val) {
+      runEnds.back() = end;
+    } else {
+      runValues.push_back(val);
+      runEnds.push_back(end);
+    }
+  }
+
+  int size() const {
+    return runEnds.empty() ? 0 : runEnds.back();
+  }
+};
+
+SortedRuns getSortedRuns(const vector<double>& values) {
+  SortedRuns runs;
+  for (int i = 0; i < values.size(); i++) {
+    runs.add(values[i], i + 1);
+  }
+  return runs;
+}
 
-  const int stepSize = ceil(fv.size()/(1.0 + maxValue));
+// Cut sorted values into buckets of about the same size, fewer than
+// maxValue of them; a bucket never splits equal values
+void findTransitions(const SortedRuns& runs,
+                     uint16_t maxValue,
+                     vector<double>* transitions) {
+  const int numValues = runs.size();
+  const int stepSize = ceil(numValues/(1.0 + maxValue));
 
-  vector<int> transitions;
   int i = stepSize;
-  while (i < num) {
-    double t = idvals[i-1].val;
-    while (i < num && idvals[i].val == t) {
-      i++;
+  int r = 0;
+  while (i < numValues) {
+    // skip to the end of the run of value i - 1
+    while (runs.runEnds[r] < i) {
+      r++;
     }
-    if (i < num) {
-      transitions.push_back(i-1);
+    i = runs.runEnds[r];
+    if (i < numValues) {
+      transitions->push_back(runs.runValues[r]);
     }
     i += stepSize;
   }
 
-  CHECK(transitions.size() < maxValue)
+  CHECK(transitions->size() < maxValue)
     << " invalid bucketing: too many buckets";
+}
+
+// buckets already found with preset transitions
+template<class T>
+void fillValues(const vector<uint16_t>& buckets, vector<T>& vec) {
+  for (size_t i = 0; i < buckets.size(); i++) {
+    vec[i] = static_cast<T>(buckets[i]);
+  }
+}
+
+// Switch fd to SPARSE if most of its bins are the same, false if not
+template<class T>
+bool makeSparse(const vector<T>& bins, FeatureData& fd) {
+  // no bin can hold more than all the examples: don't count them
+  if (FLAGS_sparse_threshold > 1.0) {
+    return false;
+  }
+  vector<int> counts(fd.transitions.size() + 1, 0);
+  for (const T v : bins) {
+    counts[v]++;
+  }
+  const int defaultBin = max_element(counts.begin(), counts.end())
+    - counts.begin();
+  if (counts[defaultBin] < FLAGS_sparse_threshold * bins.size()) {
+    return false;
+  }
+
+  fd.ivec.reset(new vector<int>());
+  vector<uint16_t>* sparseBins = new vector<uint16_t>();
+  fd.ivec->reserve(bins.size() - counts[defaultBin]);
+  sparseBins->reserve(bins.size() - counts[defaultBin]);
+  for (int i = 0; i < bins.size(); i++) {
+    if (bins[i] != defaultBin) {
+      fd.ivec->push_back(i);
+      sparseBins->push_back(bins[i]);
+    }
+  }
+
+  fd.encoding = SPARSE;
+  fd.defaultBin = defaultBin;
+  fd.svec.reset(sparseBins);  // bins may have been svec
+  fd.bvec.reset();
+  return true;
+}
+
+// pack bins of at most 4 bits in place, two per byte
+void packNibbles(vector<uint8_t>* vec) {
+  auto& v = *vec;
+  for (size_t i = 0; i < v.size(); i += 2) {
+    const uint8_t high = (i + 1 < v.size()) ? v[i + 1] : 0;
+    v[i / 2] = v[i] | (high << 4);
+  }
+  v.resize(getNibbleBytes(v.size()));
+}
+
+// With presetTransitions, fd already has its transitions, and either the
+// buckets of its examples or its raw values
+void Bucketize(FeatureData& fd, int fid, bool useByteEncoding,
+               bool presetTransitions) {
+  CHECK(fd.encoding == DOUBLE) << "invalid data to bucketing";
+
+  const int num = fd.pvec ? fd.pvec->size() : fd.fvec->size();
+
+  uint16_t maxValue
+    = useByteEncoding ? numeric_limits<uint8_t>::max() : numeric_limits<uint16_t>::max();
 
-  for(int i = 0; i < transitions.size(); i++) {
-    fd.transitions.push_back(idvals[transitions[i]].val);
+  if (!presetTransitions) {
+    findTransitions(getSortedRuns(getSortedValues(*fd.fvec, fid)),
+                    maxValue, &fd.transitions);
   }
 
-  bool byteEncoding = (transitions.size() < numeric_limits<uint8_t>::max());
-  if (transitions.size() == 0) {
+  bool nibbleEncoding = (fd.transitions.size() < 16);
+  bool byteEncoding = (fd.transitions.size() < numeric_limits<uint8_t>::max());
+  if (fd.transitions.size() == 0) {
     fd.encoding = EMPTY;
   } else if (byteEncoding) {
-    fd.encoding = BYTE;
+    fd.encoding = nibbleEncoding ? NIBBLE : BYTE;
     fd.bvec.reset(new vector<uint8_t>(num));
-    fillValues<uint8_t>(idvals, transitions, *(fd.bvec));
+    if (fd.pvec) {
+      fillValues<uint8_t>(*fd.pvec, *(fd.bvec));
+    } else {
+      fillValues<uint8_t>(*fd.fvec, fd.transitions, *(fd.bvec));
+    }
+    if (!makeSparse(*fd.bvec, fd) && nibbleEncoding) {
+      packNibbles(fd.bvec.get());
+    }
   } else {
     fd.encoding = SHORT;
     fd.svec.reset(new vector<uint16_t>(num));
-    fillValues<uint16_t>(idvals, transitions, *(fd.svec));
+    if (fd.pvec) {
+      fillValues<uint16_t>(*fd.pvec, *(fd.svec));
+    } else {
+      fillValues<uint16_t>(*fd.fvec, fd.transitions, *(fd.svec));
+    }
+    makeSparse(*fd.svec, fd);
   }
 
-  check(fd);
+  // there are no raw values with preset transitions
+  if (FLAGS_check_bucketing && fd.fvec) {
+    check(fd);
+  }
 
   // free up the original vector
   fd.fvec.reset();
+  fd.pvec.reset();
+}
+
+void DataSet::setTransitions(const vector<vector<double>>& transitions) {
+  CHECK(preBucketing_ && numExamples_ == 0)
+    << "transitions should be set before adding examples";
+  CHECK(transitions.size() == numFeatures_) << "wrong number of features";
+
+  for (int i = 0; i < numFeatures_; i++) {
+    auto& fd = features_[i];
+    CHECK(transitions[i].size() < numeric_limits<uint16_t>::max())
+      << "too many transitions";
+    fd.transitions = transitions[i];
+    fd.pvec.reset(new vector<uint16_t>());
+    if (bucketingThresh_ != -1) {
+      fd.pvec->reserve(bucketingThresh_ + 1);
+    }
+    fd.fvec.reset();
+  }
+  presetTransitions_ = true;
+}
+
+void DataSet::shareTransitions() {
+  CHECK(preBucketing_ && numExamples_ == 0 && !presetTransitions_)
+    << "transitions should be shared before adding examples";
+  sharedTransitions_ = true;
+}
+
+void DataSet::exchangeTransitions() {
+  // The values transitions are searched in (see getSortedValues), as runs
+  // of equal values, each weighted by the number of examples it stands
+  // for. Past --shared_bucketing_values runs, consecutive ones are merged
+  // into runs of about equal weight, at the largest of their values, so
+  // that the message doesn't grow with the examples. All the features in
+  // one message: # runs, values, weights
+  const size_t maxRuns = FLAGS_shared_bucketing_values;
+  vector<vector<double>> runValues(numFeatures_);
+  vector<vector<double>> runWeights(numFeatures_);
+  Concurrency::parallelFor(0, numFeatures_, 1, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        const auto& fv = *(features_[i].fvec);
+        const vector<double> values = getSortedValues(fv, i);
+        const double weight = fv.size() / max(1.0, double(values.size()));
+        auto& vals = runValues[i];
+        auto& weights = runWeights[i];
+        for (const double val : values) {
+          if (!vals.empty() && vals.back() == val) {
+            weights.back() += weight;
+          } else {
+            vals.push_back(val);
+            weights.push_back(weight);
+          }
+        }
+        if (maxRuns == 0 || vals.size() <= maxRuns) {
+          continue;
+        }
+
+        const double step = fv.size() / double(maxRuns);
+        double total = 0.0;     // weight of the runs so far
+        double merged = 0.0;    // of the merged runs so far
+        double next = step;     // total weight to end the next merged run at
+        size_t numMerged = 0;
+        for (size_t r = 0; r < vals.size(); r++) {
+          total += weights[r];
+          if (total >= next || r + 1 == vals.size()) {
+            vals[numMerged] = vals[r];
+            weights[numMerged] = total - merged;
+            numMerged++;
+            merged = total;
+            while (next <= total) {
+              next += step;
+            }
+          }
+        }
+        vals.resize(numMerged);
+        weights.resize(numMerged);
+      }
+    });
+  vector<double> message;
+  for (int i = 0; i < numFeatures_; i++) {
+    message.push_back(runValues[i].size());
+    message.insert(message.end(), runValues[i].begin(), runValues[i].end());
+    message.insert(message.end(), runWeights[i].begin(), runWeights[i].end());
+  }
+  vector<vector<double>> messages;
+  Comm::gather(message, &messages);
+
+  // rank 0 merges the runs of every feature over the ranks, and cuts them
+  // into buckets as Bucketize would; for each feature: # transitions, then
+  // the transitions
+  vector<vector<double>> transitions(numFeatures_);
+  vector<double> all;
+  if (Comm::getRank() == 0) {
+    const int numRanks = messages.size();
+    vector<vector<size_t>> offsets(numRanks, vector<size_t>(numFeatures_));
+    for (int rank = 0; rank < numRanks; rank++) {
+      size_t pos = 0;
+      for (int i = 0; i < numFeatures_; i++) {
+        offsets[rank][i] = pos;
+        pos += 1 + 2 * static_cast<size_t>(messages[rank][pos]);
+      }
+    }
+    Concurrency::parallelFor(0, numFeatures_, 1, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+          vector<pair<double, double>> runs;
+          for (int rank = 0; rank < numRanks; rank++) {
+            const double* m = messages[rank].data() + offsets[rank][i];
+            const size_t n = m[0];
+            for (size_t r = 0; r < n; r++) {
+              runs.emplace_back(m[1 + r], m[1 + n + r]);
+            }
+          }
+          sort(runs.begin(), runs.end());
+          SortedRuns merged;
+          double weight = 0.0;
+          for (const auto& run : runs) {
+            weight += run.second;
+            merged.add(run.first, lround(weight));
+          }
+          findTransitions(merged, cfg_.isWeakFeature(i)
+                          ? numeric_limits<uint8_t>::max()
+                          : numeric_limits<uint16_t>::max(),
+                          &transitions[i]);
+        }
+      });
+    for (const auto& t : transitions) {
+      all.push_back(t.size());
+      all.insert(all.end(), t.begin(), t.end());
+    }
+  }
+  Comm::broadcast(&all);
+
+  size_t pos = 0;
+  for (int i = 0; i < numFeatures_; i++) {
+    const size_t n = all[pos];
+    features_[i].transitions.assign(all.begin() + pos + 1,
+                                    all.begin() + pos + 1 + n);
+    pos += 1 + n;
+  }
 }
 
 void DataSet::bucketize() {
@@ -240,24 +732,438 @@ void DataSet::bucketize() {
     return;
   }
 
+  const bool presetTransitions = presetTransitions_ || sharedTransitions_;
+  if (sharedTransitions_ && !presetTransitions_) {
+    LOG(INFO) << "exchanging values for bucketing after " << numExamples_
+              << " examples";
+    exchangeTransitions();
+  }
+
   LOG(INFO) << "start bucketization for data compression";
-  int hist[4];
+  int hist[6];
   memset(hist, 0, sizeof(hist));
+  double bytes = 0.0;  // per example, over all features
+
+  Concurrency::parallelFor(0, numFeatures_, 1, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        Bucketize(features_[i], i, cfg_.isWeakFeature(i),
+                  presetTransitions);
+      }
+    });
 
   for (int i = 0; i < numFeatures_; i++) {
-    Bucketize(features_[i], cfg_.isWeakFeature(i));
-    hist[features_[i].encoding]++;
+    const auto& f = features_[i];
+    hist[f.encoding]++;
+    if (f.encoding == NIBBLE) {
+      bytes += 0.5;
+    } else if (f.encoding == BYTE) {
+      bytes += 1.0;
+    } else if (f.encoding == SHORT) {
+      bytes += 2.0;
+    } else if (f.encoding == SPARSE) {
+      bytes += f.ivec->size() * (sizeof(int) + sizeof(uint16_t))
+        / max(1.0, double(numExamples_));
+    }
 
     LOG(INFO) << "feature: " << cfg_.getFeatureName(i)
               << " num transitions: " << features_[i].transitions.size()
               << ",encoding: " << features_[i].encoding;
   }
   preBucketing_ = false;
-  CHECK(hist[3] == 0) << "no double features after bucketing";
+  CHECK(hist[DOUBLE] == 0) << "no double features after bucketing";
+  LOG(INFO) << "num sparse features: " << hist[SPARSE];
   LOG(INFO) << "total memory saving over double: "
-            << 1 - (hist[1] * 0.5 + hist[2])/(4.0*numFeatures_);
+            << 1 - bytes/(8.0*numFeatures_);
   LOG(INFO) << "additional memory saving over short: "
-            << 1 - (hist[1] * 0.5 + hist[2])/numFeatures_;
+            << 1 - bytes/(2.0*numFeatures_);
+}
+
+// Layout of the data cache file, in native byte order:
+//   magic, version, # features, # examples
+//   for each feature: name length, name, encoding, # transitions,
+//     transitions
+//   targets
+//   for each non empty feature: its bins, starting at a multiple of
+//     CACHE_ALIGNMENT so that they can be used in place once mapped;
+//     for SPARSE ones: # sparse examples, default bucket, then (aligned)
+//     the ids and the bins of those examples
+static const uint64_t CACHE_MAGIC = 0x4154414442534621ULL;  // "!FSBDATA"
+static const uint32_t CACHE_VERSION = 1;
+static const size_t CACHE_ALIGNMENT = 64;
+
+template<class T>
+static void writeCache(ofstream& fs, const T* data, size_t n) {
+  fs.write(reinterpret_cast<const char*>(data), n * sizeof(T));
+}
+
+static void padCache(ofstream& fs) {
+  static const char zeros[CACHE_ALIGNMENT] = {0};
+  const size_t pos = fs.tellp();
+  writeCache(fs, zeros, (CACHE_ALIGNMENT - pos % CACHE_ALIGNMENT)
+             % CACHE_ALIGNMENT);
+}
+
+// bounds checked reads from a mapped cache file
+class CacheReader {
+ public:
+  CacheReader(const char* begin, size_t size)
+    : begin_(begin), pos_(begin), end_(begin + size) {
+  }
+
+  // n values of type T, in place; NULL if the file is too short
+  template<class T>
+  const T* get(size_t n) {
+    if (n > (end_ - pos_) / sizeof(T)) {
+      return NULL;
+    }
+    const T* data = reinterpret_cast<const T*>(pos_);
+    pos_ += n * sizeof(T);
+    return data;
+  }
+
+  template<class T>
+  bool read(T* value) {
+    const T* data = get<T>(1);
+    if (data == NULL) {
+      return false;
+    }
+    memcpy(value, data, sizeof(T));
+    return true;
+  }
+
+  void align() {
+    const size_t pos = pos_ - begin_;
+    pos_ += min<size_t>((CACHE_ALIGNMENT - pos % CACHE_ALIGNMENT)
+                        % CACHE_ALIGNMENT, end_ - pos_);
+  }
+
+ private:
+  const char* begin_;
+  const char* pos_;
+  const char* end_;
+};
+
+bool DataSet::save(const string& fileName) const {
+  CHECK(!preBucketing_) << "save the data set after closing it";
+
+  ofstream fs(fileName, ios::binary | ios::trunc);
+  if (!fs) {
+    LOG(ERROR) << "fail to open data cache file: " << fileName;
+    return false;
+  }
+
+  const uint32_t numFeatures = numFeatures_;
+  const uint64_t numExamples = numExamples_;
+  writeCache(fs, &CACHE_MAGIC, 1);
+  writeCache(fs, &CACHE_VERSION, 1);
+  writeCache(fs, &numFeatures, 1);
+  writeCache(fs, &numExamples, 1);
+
+  for (int fid = 0; fid < numFeatures_; fid++) {
+    const auto& f = features_[fid];
+    const string& name = cfg_.getFeatureName(fid);
+    const uint32_t nameSize = name.size();
+    const int32_t encoding = f.encoding;
+    const uint32_t numTransitions = f.transitions.size();
+    writeCache(fs, &nameSize, 1);
+    writeCache(fs, name.data(), nameSize);
+    writeCache(fs, &encoding, 1);
+    writeCache(fs, &numTransitions, 1);
+    writeCache(fs, f.transitions.data(), numTransitions);
+  }
+
+  padCache(fs);
+  writeCache(fs, targets_.data(), numExamples_);
+
+  for (int fid = 0; fid < numFeatures_; fid++) {
+    const auto& f = features_[fid];
+    padCache(fs);
+    if (f.encoding == SPARSE) {
+      const uint64_t numSparse = f.numSparse;
+      const uint32_t defaultBin = f.defaultBin;
+      writeCache(fs, &numSparse, 1);
+      writeCache(fs, &defaultBin, 1);
+      padCache(fs);
+      writeCache(fs, f.sids, numSparse);
+      padCache(fs);
+      writeCache(fs, f.sbins, numSparse);
+    } else if (f.encoding == NIBBLE) {
+      writeCache(fs, f.bbins, getNibbleBytes(numExamples_));
+    } else if (f.encoding == BYTE) {
+      writeCache(fs, f.bbins, numExamples_);
+    } else if (f.encoding == SHORT) {
+      writeCache(fs, f.sbins, numExamples_);
+    }
+  }
+
+  fs.close();
+  if (!fs) {
+    LOG(ERROR) << "fail to write data cache file: " << fileName;
+    return false;
+  }
+  LOG(INFO) << "wrote " << numExamples_ << " examples to " << fileName;
+  return true;
+}
+
+// whether the numExamples bins of f, read from a data cache file, are all
+// buckets of it (at most f.transitions.size())
+static bool hasValidBins(const FeatureData& f, int numExamples) {
+  const size_t maxBin = f.transitions.size();
+  if (f.encoding == SPARSE) {
+    if (f.defaultBin > maxBin) {
+      return false;
+    }
+    for (int i = 0; i < f.numSparse; i++) {
+      if (f.sids[i] < 0 || f.sids[i] >= numExamples
+          || (i > 0 && f.sids[i] <= f.sids[i - 1])
+          || f.sbins[i] > maxBin) {
+        return false;
+      }
+    }
+  } else if (f.encoding == NIBBLE) {
+    const NibbleBins bins(f.bbins);
+    for (int eid = 0; eid < numExamples; eid++) {
+      if (bins[eid] > maxBin) {
+        return false;
+      }
+    }
+  } else if (f.encoding == BYTE) {
+    for (int eid = 0; eid < numExamples; eid++) {
+      if (f.bbins[eid] > maxBin) {
+        return false;
+      }
+    }
+  } else if (f.encoding == SHORT) {
+    for (int eid = 0; eid < numExamples; eid++) {
+      if (f.sbins[eid] > maxBin) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool DataSet::load(const string& fileName) {
+  CHECK(preBucketing_ && numExamples_ == 0 && mapped_ == NULL)
+    << "load into an empty data set";
+
+  const int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "fail to open data cache file: " << fileName;
+    return false;
+  }
+  struct stat st;
+  void* mapped = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  ::close(fd);
+  if (mapped == MAP_FAILED) {
+    LOG(ERROR) << "fail to map data cache file: " << fileName;
+    return false;
+  }
+  mapped_ = mapped;
+  mappedSize_ = st.st_size;
+
+  CacheReader reader(static_cast<const char*>(mapped_), mappedSize_);
+  uint64_t magic, numExamples;
+  uint32_t version, numFeatures;
+  if (!reader.read(&magic) || magic != CACHE_MAGIC
+      || !reader.read(&version) || version != CACHE_VERSION
+      || !reader.read(&numFeatures) || numFeatures != numFeatures_
+      || !reader.read(&numExamples)
+      || numExamples > numeric_limits<int>::max()) {
+    LOG(ERROR) << "invalid data cache file or version: " << fileName;
+    return false;
+  }
+
+  for (int fid = 0; fid < numFeatures_; fid++) {
+    auto& f = features_[fid];
+    uint32_t nameSize, numTransitions;
+    int32_t encoding;
+    const char* name;
+    const double* transitions;
+    if (!reader.read(&nameSize)
+        || (name = reader.get<char>(nameSize)) == NULL
+        || !reader.read(&encoding)
+        || !reader.read(&numTransitions)
+        || (transitions = reader.get<double>(numTransitions)) == NULL) {
+      LOG(ERROR) << "truncated data cache file: " << fileName;
+      return false;
+    }
+    if (string(name, nameSize) != cfg_.getFeatureName(fid)
+        || (encoding != EMPTY && encoding != NIBBLE && encoding != BYTE
+            && encoding != SHORT && encoding != SPARSE)) {
+      LOG(ERROR) << "data cache file " << fileName
+                 << " doesn't match the config at feature " << fid;
+      return false;
+    }
+    f.encoding = static_cast<FeatureEncoding>(encoding);
+    f.transitions.assign(transitions, transitions + numTransitions);
+    f.fvec.reset();
+  }
+
+  reader.align();
+  const double* targets = reader.get<double>(numExamples);
+  bool valid = (targets != NULL);
+  for (int fid = 0; valid && fid < numFeatures_; fid++) {
+    auto& f = features_[fid];
+    reader.align();
+    if (f.encoding == SPARSE) {
+      uint64_t numSparse;
+      uint32_t defaultBin;
+      valid = reader.read(&numSparse) && reader.read(&defaultBin)
+        && numSparse <= numExamples
+        && defaultBin <= numeric_limits<uint16_t>::max();
+      if (valid) {
+        reader.align();
+        f.sids = reader.get<int>(numSparse);
+        reader.align();
+        f.sbins = reader.get<uint16_t>(numSparse);
+        f.defaultBin = defaultBin;
+        f.numSparse = numSparse;
+        valid = (f.sids != NULL && f.sbins != NULL);
+      }
+    } else if (f.encoding == NIBBLE) {
+      valid = (f.bbins = reader.get<uint8_t>(getNibbleBytes(numExamples)))
+        != NULL;
+    } else if (f.encoding == BYTE) {
+      valid = (f.bbins = reader.get<uint8_t>(numExamples)) != NULL;
+    } else if (f.encoding == SHORT) {
+      valid = (f.sbins = reader.get<uint16_t>(numExamples)) != NULL;
+    }
+  }
+  if (!valid) {
+    LOG(ERROR) << "truncated data cache file: " << fileName;
+    return false;
+  }
+
+  // A stale or damaged file mustn't send histogram building past the end
+  // of a histogram: every bin has to be one of the buckets of its feature,
+  // and the ids of a sparse one ascending examples
+  vector<char> corrupt(numFeatures_, false);
+  Concurrency::parallelFor(0, numFeatures_, 1, [&](int begin, int end) {
+      for (int fid = begin; fid < end; fid++) {
+        corrupt[fid] = !hasValidBins(features_[fid], numExamples);
+      }
+    });
+  for (int fid = 0; fid < numFeatures_; fid++) {
+    if (corrupt[fid]) {
+      LOG(ERROR) << "corrupt data cache file: " << fileName
+                 << " at feature " << fid;
+      return false;
+    }
+  }
+
+  // as many examples as addVector would have taken
+  numExamples_ = numExamples;
+  if (examplesThresh_ != -1) {
+    numExamples_ = min(numExamples_, examplesThresh_ + 1);
+  }
+  for (int fid = 0; fid < numFeatures_; fid++) {
+    auto& f = features_[fid];
+    f.numSparse = lower_bound(f.sids, f.sids + f.numSparse, numExamples_)
+      - f.sids;
+  }
+  targets_.assign(targets, targets + numExamples_);
+  preBucketing_ = false;
+
+  buildFeatureGroups();
+  placeFeatures();
+
+  LOG(INFO) << "mapped " << numExamples_ << " examples from " << fileName;
+  return true;
+}
+
+void DataSet::buildFeatureGroups() {
+  groups_.clear();
+  groupIds_.assign(numFeatures_, -1);
+  groupOffsets_.assign(numFeatures_, -1);
+  if (FLAGS_feature_group_size <= 0) {
+    return;
+  }
+
+  for (int fid = 0; fid < numFeatures_; fid++) {
+    const auto encoding = features_[fid].encoding;
+    if (encoding != NIBBLE && encoding != BYTE) {
+      continue;
+    }
+    if (groups_.empty() || groups_.back().size() == FLAGS_feature_group_size) {
+      groups_.emplace_back();
+    }
+    groupIds_[fid] = groups_.size() - 1;
+    groupOffsets_[fid] = groups_.back().size();
+    groups_.back().fids.push_back(fid);
+  }
+
+  Concurrency::parallelFor(0, groups_.size(), 1, [this](int begin, int end) {
+      for (int g = begin; g < end; g++) {
+        auto& group = groups_[g];
+        const int width = group.size();
+        group.bins.resize(static_cast<size_t>(numExamples_) * width);
+        for (int j = 0; j < width; j++) {
+          for (int eid = 0; eid < numExamples_; eid++) {
+            group.bins[static_cast<size_t>(eid) * width + j]
+              = getBucket(group.fids[j], eid);
+          }
+        }
+      }
+    });
+  LOG(INFO) << "built " << groups_.size() << " row major feature groups";
+}
+
+// Point *bins at a copy of its n values in *v, made by the calling thread,
+// whose pages are placed on its node when first written. The bins may be
+// the ones of *v, or in a mapped data cache file.
+template<class T>
+static void relocate(const T** bins, size_t n, unique_ptr<vector<T>>* v) {
+  if (*bins != NULL) {
+    unique_ptr<vector<T>> copy(new vector<T>(*bins, *bins + n));
+    v->swap(copy);
+    *bins = (*v)->data();
+  }
+}
+
+void DataSet::placeFeatures() {
+  const int numNodes = Concurrency::getNumaNodes().size();
+  if (!FLAGS_numa_place_features || numNodes <= 1) {
+    return;
+  }
+  LOG(INFO) << "placing features on " << numNodes << " NUMA nodes";
+
+  // one thread per node, bound to it, copies the bins of its features
+  vector<thread> threads;
+  for (int node = 0; node < numNodes; node++) {
+    threads.emplace_back([this, node, numNodes]() {
+        Concurrency::pinToNode(node);
+        for (int i = node; i < numFeatures_; i += numNodes) {
+          auto& f = features_[i];
+          if (f.encoding == SPARSE) {
+            relocate(&f.sids, f.numSparse, &f.ivec);
+            relocate(&f.sbins, f.numSparse, &f.svec);
+          } else if (f.encoding == NIBBLE) {
+            relocate(&f.bbins, getNibbleBytes(numExamples_), &f.bvec);
+          } else {
+            relocate(&f.bbins, numExamples_, &f.bvec);
+            relocate(&f.sbins, numExamples_, &f.svec);
+          }
+        }
+        for (int g = node; g < groups_.size(); g += numNodes) {
+          vector<uint8_t>(groups_[g].bins).swap(groups_[g].bins);
+        }
+      });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+int DataSet::getFeatureNode(int fid) const {
+  return fid % Concurrency::getNumaNodes().size();
+}
+
+int DataSet::getGroupNode(int g) const {
+  return g % Concurrency::getNumaNodes().size();
 }
 
 }
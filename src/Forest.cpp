@@ -0,0 +1,176 @@
+#include "Forest.h"
+
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace boosting {
+
+namespace {
+
+const uint64_t FILE_MAGIC = 0x4c444f4d42534621ULL;  // "!FSBMODL"
+const uint32_t FILE_VERSION = 2;
+const size_t FILE_ALIGNMENT = 64;
+
+template<class U>
+void write(std::ofstream& fs, const U* data, size_t n) {
+  static const char zeros[FILE_ALIGNMENT] = {0};
+  const size_t pos = fs.tellp();
+  fs.write(zeros, (FILE_ALIGNMENT - pos % FILE_ALIGNMENT) % FILE_ALIGNMENT);
+  fs.write(reinterpret_cast<const char*>(data), n * sizeof(U));
+}
+
+// n values of type U at the next multiple of FILE_ALIGNMENT from *pos in
+// a mapped file of size bytes, in place; NULL if the file is too short
+template<class U>
+const U* get(const char* begin, size_t size, size_t* pos, size_t n) {
+  const size_t start = (*pos + FILE_ALIGNMENT - 1)
+    / FILE_ALIGNMENT * FILE_ALIGNMENT;
+  if (start > size || n > (size - start) / sizeof(U)) {
+    return NULL;
+  }
+  *pos = start + n * sizeof(U);
+  return reinterpret_cast<const U*>(begin + start);
+}
+
+}
+
+template<class T>
+Forest<T>::~Forest() {
+  if (mapped_ != NULL) {
+    munmap(mapped_, mappedSize_);
+  }
+}
+
+template<class T>
+bool Forest<T>::save(const std::string& fileName, int numFeatures) const {
+  for (int node = 0; node < numNodes_; node++) {
+    CHECK(fids_[node] < numFeatures) << "feature out of range";
+  }
+  std::ofstream fs(fileName, std::ios::binary | std::ios::trunc);
+  if (!fs) {
+    LOG(ERROR) << "fail to open model file: " << fileName;
+    return false;
+  }
+  const uint32_t header[] = {
+    FILE_VERSION, sizeof(T), static_cast<uint32_t>(numFeatures),
+    static_cast<uint32_t>(numTrees_), static_cast<uint32_t>(numNodes_),
+    static_cast<uint32_t>(numLeaves_)};
+  const uint64_t magic = FILE_MAGIC;
+  write(fs, &magic, 1);
+  write(fs, header, 6);
+  write(fs, roots_, numTrees_);
+  write(fs, fids_, numNodes_);
+  write(fs, values_, numNodes_);
+  write(fs, lefts_, numNodes_);
+  write(fs, rights_, numNodes_);
+  write(fs, leafValues_, numLeaves_);
+  fs.close();
+  if (!fs) {
+    LOG(ERROR) << "fail to write model file: " << fileName;
+    return false;
+  }
+  return true;
+}
+
+template<class T>
+bool Forest<T>::load(const std::string& fileName, int numFeatures) {
+  CHECK(numTrees_ == 0 && mapped_ == NULL) << "load into an empty forest";
+
+  const int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "fail to open model file: " << fileName;
+    return false;
+  }
+  struct stat st;
+  void* mapped = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  ::close(fd);
+  if (mapped == MAP_FAILED) {
+    LOG(ERROR) << "fail to map model file: " << fileName;
+    return false;
+  }
+  mapped_ = mapped;
+  mappedSize_ = st.st_size;
+
+  const char* begin = static_cast<const char*>(mapped_);
+  size_t pos = 0;
+  // every array starts aligned, so the values can be read in place
+  const uint64_t* magic = get<uint64_t>(begin, mappedSize_, &pos, 1);
+  const uint32_t* header = get<uint32_t>(begin, mappedSize_, &pos, 6);
+  if (magic == NULL || *magic != FILE_MAGIC || header == NULL
+      || header[0] != FILE_VERSION || header[1] != sizeof(T)
+      || header[3] > std::numeric_limits<int>::max()
+      || header[4] > std::numeric_limits<int>::max()
+      || header[5] > std::numeric_limits<int>::max()) {
+    LOG(ERROR) << "invalid model file or version: " << fileName;
+    return unload();
+  }
+  if (header[2] != static_cast<uint32_t>(numFeatures)) {
+    LOG(ERROR) << "model file " << fileName << " is for " << header[2]
+               << " features, not " << numFeatures;
+    return unload();
+  }
+  const int numTrees = header[3];
+  const int numNodes = header[4];
+  const int numLeaves = header[5];
+
+  const int* roots = get<int>(begin, mappedSize_, &pos, numTrees);
+  const int* fids = get<int>(begin, mappedSize_, &pos, numNodes);
+  const T* values = get<T>(begin, mappedSize_, &pos, numNodes);
+  const int* lefts = get<int>(begin, mappedSize_, &pos, numNodes);
+  const int* rights = get<int>(begin, mappedSize_, &pos, numNodes);
+  const double* leafValues = get<double>(begin, mappedSize_, &pos, numLeaves);
+  if (leafValues == NULL || roots == NULL || fids == NULL
+      || values == NULL || lefts == NULL || rights == NULL) {
+    LOG(ERROR) << "truncated model file: " << fileName;
+    return unload();
+  }
+
+  auto valid = [numNodes, numLeaves](int child, int parent) {
+    return (child < 0) ? ~child < numLeaves
+      : (child > parent && child < numNodes);
+  };
+  for (int tid = 0; tid < numTrees; tid++) {
+    if (!valid(roots[tid], -1)) {
+      LOG(ERROR) << "corrupt model file: " << fileName;
+      return unload();
+    }
+  }
+  for (int node = 0; node < numNodes; node++) {
+    if (fids[node] < 0 || fids[node] >= numFeatures
+        || !valid(lefts[node], node)
+        || !valid(rights[node], node)) {
+      LOG(ERROR) << "corrupt model file: " << fileName;
+      return unload();
+    }
+  }
+
+  numTrees_ = numTrees;
+  numNodes_ = numNodes;
+  numLeaves_ = numLeaves;
+  roots_ = roots;
+  fids_ = fids;
+  values_ = values;
+  lefts_ = lefts;
+  rights_ = rights;
+  leafValues_ = leafValues;
+  setDepths();
+  return true;
+}
+
+template<class T>
+bool Forest<T>::unload() {
+  munmap(mapped_, mappedSize_);
+  mapped_ = NULL;
+  mappedSize_ = 0;
+  return false;
+}
+
+template class Forest<double>;
+
+}
@@ -1,17 +1,56 @@
 #include "Gbm.h"
 
+#include <algorithm>
 #include <boost/scoped_array.hpp>
-#include <boost/shared_ptr.hpp>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include "Comm.h"
 #include "Concurrency.h"
 #include "Config.h"
 #include "DataSet.h"
 #include "GbmFun.h"
+#include "Random.h"
+#include "Stats.h"
 #include "Tree.h"
 #include "TreeRegressor.h"
 #include "gflags/gflags.h"
 
+DECLARE_int32(seed);
+DECLARE_bool(level_wise);
+DECLARE_bool(sample_features_per_tree);
+DECLARE_int32(min_leaf_examples);
+DECLARE_int32(min_block_examples);
+DECLARE_int32(min_group_examples);
+DECLARE_bool(compact_rows);
+DECLARE_int32(histogram_cache_mb);
+DECLARE_int32(feature_group_size);
+DECLARE_double(sparse_threshold);
+
+DEFINE_bool(float_gradients, false,
+            "build the histograms of the trees from a single precision "
+            "copy of the gradients, halving their memory traffic");
+
+DEFINE_int32(early_stopping_rounds, 0,
+             "with validation data, stop training once its loss hasn't "
+             "improved for this many trees, and keep the model up to the "
+             "best one; 0 trains all the trees");
+
+DEFINE_string(checkpoint_file, "",
+              "if set, the training state is written there (in the "
+              "background) every checkpoint_every trees, and training "
+              "resumes from it if it exists; each rank of a distributed "
+              "run appends .<rank>");
+
+DEFINE_int32(checkpoint_every, 10,
+             "number of trees between two checkpoints");
+
 namespace boosting {
 
 using namespace std;
@@ -20,123 +59,562 @@ Gbm::Gbm(const GbmFun& fun, const DataSet& ds, const Config& cfg)
   : fun_(fun), ds_(ds), cfg_(cfg) {
 }
 
-class ParallelEval : public apache::thrift::concurrency::Runnable {
- public:
-  ParallelEval(
-    CounterMonitor& monitor,
-    const int numExamples,
-    const int numFeatures,
-    const GbmFun& fun,
-    const std::unique_ptr<TreeNode<uint16_t>>& weakModel,
-    const DataSet& ds,
-    const vector<double>& targets,
-    boost::scoped_array<double>& F,
-    boost::scoped_array<double>& subLoss,
-    const int workIdx,
-    const int totalWorkers)
-    : monitor_(monitor), numExamples_(numExamples),
-      numFeatures_(numFeatures), fun_(fun), weakModel_(weakModel),
-      ds_(ds), targets_(targets), F_(F),
-      subLoss_(subLoss), workIdx_(workIdx),
-      totalWorkers_(totalWorkers) {
-  }
-
-  void run() {
-    //boost::scoped_array<uint16_t> fvec(new uint16_t[numFeatures_]);
-    for (int i = 0; i < numExamples_; i++) {
-      if (i % totalWorkers_ == workIdx_) {
-        //ds_.getFeatureVec(i, fvec);
-        //double score = weakModel_->eval(fvec);
-        double score = ds_.getPrediction(weakModel_.get(), i);
-        F_[i] += score;
-        subLoss_[workIdx_] += fun_.getExampleLoss(targets_[i], F_[i]);
+// number of examples per task of the parallel eval step
+const int EVAL_CHUNK_SIZE = 1 << 14;
+
+// Layout of the checkpoint file, in native byte order:
+//   magic, version, # examples, # features, # validation examples,
+//   the settings the trees depend on (see Checkpoint), the hash of the
+//   transitions and the sum of the targets, # trees, best # trees,
+//   initial loss, best validation loss
+//   F, fimps, validation scores, fimps of the best # trees
+//   F0 and the trees, in preorder: a tag for each node (PARTITION_TAG or
+//   LEAF_TAG), then its fid and value, or its vote
+static const uint64_t CHECKPOINT_MAGIC = 0x54504b4342534621ULL;  // "!FSBCKPT"
+static const uint32_t CHECKPOINT_VERSION = 4;
+static const uint8_t PARTITION_TAG = 0;
+static const uint8_t LEAF_TAG = 1;
+
+// state of getModel after numTrees trees; the random draws of the next
+// tree only depend on its number
+struct Checkpoint {
+  // A run only resumes from a checkpoint with the same settings, every one
+  // that shapes the trees or the order their sums are taken in, and the
+  // same data: transitions (whatever bucketing found them) and targets
+  int64_t seed;
+  int64_t numLeaves;
+  double learningRate;
+  double exampleSamplingRate;
+  double featureSamplingRate;
+  uint8_t floatGradients;
+  uint8_t levelWise;
+  uint8_t featuresPerTree;
+  int64_t minLeafExamples;
+  int64_t minBlockExamples;
+  int64_t minGroupExamples;
+  uint8_t compactRows;
+  int64_t histogramCacheMb;
+  int64_t featureGroupSize;
+  double sparseThreshold;
+  uint64_t transitionsHash;
+  double targetSum;
+
+  int64_t numTrees;
+  int64_t bestNumTrees;
+  double initLoss;
+  double bestValidLoss;
+  vector<double> F;
+  vector<double> fimps;
+  vector<double> validF;
+  vector<double> bestFimps;
+  string model;  // serialized by writeTree
+
+  Checkpoint() : seed(0), numLeaves(0), learningRate(0.0),
+                 exampleSamplingRate(0.0), featureSamplingRate(0.0),
+                 floatGradients(0), levelWise(0), featuresPerTree(0),
+                 minLeafExamples(0), minBlockExamples(0), minGroupExamples(0),
+                 compactRows(0), histogramCacheMb(0), featureGroupSize(0),
+                 sparseThreshold(0.0), transitionsHash(0), targetSum(0.0),
+                 numTrees(0), bestNumTrees(0), initLoss(0.0),
+                 bestValidLoss(0.0) {
+  }
+
+  bool sameSettings(const Checkpoint& other) const {
+    return seed == other.seed && numLeaves == other.numLeaves
+      && learningRate == other.learningRate
+      && exampleSamplingRate == other.exampleSamplingRate
+      && featureSamplingRate == other.featureSamplingRate
+      && floatGradients == other.floatGradients
+      && levelWise == other.levelWise
+      && featuresPerTree == other.featuresPerTree
+      && minLeafExamples == other.minLeafExamples
+      && minBlockExamples == other.minBlockExamples
+      && minGroupExamples == other.minGroupExamples
+      && compactRows == other.compactRows
+      && histogramCacheMb == other.histogramCacheMb
+      && featureGroupSize == other.featureGroupSize
+      && sparseThreshold == other.sparseThreshold
+      && transitionsHash == other.transitionsHash
+      && targetSum == other.targetSum;
+  }
+};
+
+template<class T>
+static void writeValue(ostream& os, const T& value) {
+  os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<class T>
+static bool readValue(istream& is, T* value) {
+  return static_cast<bool>(
+    is.read(reinterpret_cast<char*>(value), sizeof(T)));
+}
+
+static void writeVector(ostream& os, const vector<double>& v) {
+  os.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(double));
+}
+
+static bool readVector(istream& is, size_t n, vector<double>* v) {
+  v->resize(n);
+  return static_cast<bool>(
+    is.read(reinterpret_cast<char*>(v->data()), n * sizeof(double)));
+}
+
+static void writeTree(ostream& os, const TreeNode<double>* node) {
+  const PartitionNode<double>* pnode =
+    dynamic_cast<const PartitionNode<double>*>(node);
+  if (pnode != NULL) {
+    writeValue(os, PARTITION_TAG);
+    writeValue(os, static_cast<int32_t>(pnode->getFid()));
+    writeValue(os, pnode->getFv());
+    writeTree(os, pnode->getLeft());
+    writeTree(os, pnode->getRight());
+  } else {
+    writeValue(os, LEAF_TAG);
+    writeValue(os,
+               dynamic_cast<const LeafNode<double>*>(node)->getVote());
+  }
+}
+
+// NULL if the tree is cut short or invalid
+static TreeNode<double>* readTree(istream& is, int numFeatures) {
+  uint8_t tag;
+  double value;
+  if (!readValue(is, &tag)) {
+    return NULL;
+  }
+  if (tag == LEAF_TAG) {
+    return readValue(is, &value) ? new LeafNode<double>(value) : NULL;
+  }
+  int32_t fid;
+  if (tag != PARTITION_TAG || !readValue(is, &fid) || !readValue(is, &value)
+      || fid < 0 || fid >= numFeatures) {
+    return NULL;
+  }
+  unique_ptr<PartitionNode<double>> node(
+    new PartitionNode<double>(fid, value));
+  node->setLeft(readTree(is, numFeatures));
+  if (node->getLeft() == NULL) {
+    return NULL;
+  }
+  node->setRight(readTree(is, numFeatures));
+  if (node->getRight() == NULL) {
+    return NULL;
+  }
+  return node.release();
+}
+
+// written to a temporary file first, which then replaces fileName, so
+// that a job killed while writing still has the previous checkpoint
+static bool writeCheckpoint(const string& fileName, const Checkpoint& c) {
+  const string tmpFile = fileName + ".tmp";
+  ofstream fs(tmpFile, ios::binary | ios::trunc);
+  writeValue(fs, CHECKPOINT_MAGIC);
+  writeValue(fs, CHECKPOINT_VERSION);
+  writeValue(fs, static_cast<int64_t>(c.F.size()));
+  writeValue(fs, static_cast<int64_t>(c.fimps.size()));
+  writeValue(fs, static_cast<int64_t>(c.validF.size()));
+  writeValue(fs, c.seed);
+  writeValue(fs, c.numLeaves);
+  writeValue(fs, c.learningRate);
+  writeValue(fs, c.exampleSamplingRate);
+  writeValue(fs, c.featureSamplingRate);
+  writeValue(fs, c.floatGradients);
+  writeValue(fs, c.levelWise);
+  writeValue(fs, c.featuresPerTree);
+  writeValue(fs, c.minLeafExamples);
+  writeValue(fs, c.minBlockExamples);
+  writeValue(fs, c.minGroupExamples);
+  writeValue(fs, c.compactRows);
+  writeValue(fs, c.histogramCacheMb);
+  writeValue(fs, c.featureGroupSize);
+  writeValue(fs, c.sparseThreshold);
+  writeValue(fs, c.transitionsHash);
+  writeValue(fs, c.targetSum);
+  writeValue(fs, c.numTrees);
+  writeValue(fs, c.bestNumTrees);
+  writeValue(fs, c.initLoss);
+  writeValue(fs, c.bestValidLoss);
+  writeVector(fs, c.F);
+  writeVector(fs, c.fimps);
+  writeVector(fs, c.validF);
+  writeVector(fs, c.bestFimps);
+  fs.write(c.model.data(), c.model.size());
+  fs.close();
+  if (!fs || rename(tmpFile.c_str(), fileName.c_str()) != 0) {
+    LOG(ERROR) << "fail to write checkpoint file: " << fileName;
+    return false;
+  }
+  return true;
+}
+
+// Read a checkpoint of a run on numExamples examples with numFeatures
+// features (and numValid validation examples) into c, and its F0 and
+// trees into model. Fails if its settings aren't the ones of current.
+static bool readCheckpoint(const string& fileName, size_t numExamples,
+                           size_t numFeatures, size_t numValid,
+                           const Checkpoint& current,
+                           Checkpoint* c, vector<TreeNode<double>*>* model) {
+  ifstream fs(fileName, ios::binary);
+  uint64_t magic;
+  uint32_t version;
+  int64_t n, f, v;
+  if (!readValue(fs, &magic) || magic != CHECKPOINT_MAGIC
+      || !readValue(fs, &version) || version != CHECKPOINT_VERSION) {
+    LOG(ERROR) << "not a checkpoint file: " << fileName;
+    return false;
+  }
+  if (!readValue(fs, &n) || !readValue(fs, &f) || !readValue(fs, &v)
+      || n != numExamples || f != numFeatures || v != numValid) {
+    LOG(ERROR) << "checkpoint of another data set: " << fileName;
+    return false;
+  }
+  if (!readValue(fs, &c->seed) || !readValue(fs, &c->numLeaves)
+      || !readValue(fs, &c->learningRate)
+      || !readValue(fs, &c->exampleSamplingRate)
+      || !readValue(fs, &c->featureSamplingRate)
+      || !readValue(fs, &c->floatGradients) || !readValue(fs, &c->levelWise)
+      || !readValue(fs, &c->featuresPerTree)
+      || !readValue(fs, &c->minLeafExamples)
+      || !readValue(fs, &c->minBlockExamples)
+      || !readValue(fs, &c->minGroupExamples)
+      || !readValue(fs, &c->compactRows)
+      || !readValue(fs, &c->histogramCacheMb)
+      || !readValue(fs, &c->featureGroupSize)
+      || !readValue(fs, &c->sparseThreshold)
+      || !readValue(fs, &c->transitionsHash)
+      || !readValue(fs, &c->targetSum)) {
+    LOG(ERROR) << "truncated checkpoint file: " << fileName;
+    return false;
+  }
+  if (!c->sameSettings(current)) {
+    LOG(ERROR) << "checkpoint of a run with other settings or data: "
+               << fileName;
+    return false;
+  }
+  if (!readValue(fs, &c->numTrees) || !readValue(fs, &c->bestNumTrees)
+      || !readValue(fs, &c->initLoss) || !readValue(fs, &c->bestValidLoss)
+      || !readVector(fs, n, &c->F) || !readVector(fs, f, &c->fimps)
+      || !readVector(fs, v, &c->validF) || !readVector(fs, f, &c->bestFimps)
+      || c->numTrees < 0) {
+    LOG(ERROR) << "truncated checkpoint file: " << fileName;
+    return false;
+  }
+  for (int64_t i = 0; i <= c->numTrees; i++) {
+    TreeNode<double>* tree = readTree(fs, numFeatures);
+    if (tree == NULL) {
+      LOG(ERROR) << "invalid tree in checkpoint file: " << fileName;
+      for (auto t : *model) {
+        delete t;
       }
+      model->clear();
+      return false;
     }
-    monitor_.decrement();
-  }
-
- private:
-  CounterMonitor& monitor_;
-  const int numExamples_;
-  const int numFeatures_;
-  const GbmFun& fun_;
-  const std::unique_ptr<TreeNode<uint16_t>>& weakModel_;
-  const DataSet& ds_;
-  const vector<double> targets_;
-  boost::scoped_array<double>& F_;
-  boost::scoped_array<double>& subLoss_;
-  const int workIdx_;
-  const int totalWorkers_;
-};
+    model->push_back(tree);
+  }
+  return true;
+}
 
 void Gbm::getModel(
   vector<TreeNode<double>*>* model,
-  double fimps[]) {
+  double fimps[],
+  const DataSet* validation) {
 
   const int numExamples = ds_.getNumExamples();
 
+  // the calling thread is worker 0 of every loop from here on
+  Concurrency::pinCaller();
+
   boost::scoped_array<double> F(new double[numExamples]);
   boost::scoped_array<double> y(new double[numExamples]);
+  boost::scoped_array<float> yf(
+    FLAGS_float_gradients ? new float[numExamples] : NULL);
+  vector<int> leaf(numExamples);
+  const double* targets = ds_.targets_.data();
 
-  double f0 = fun_.getF0(ds_.targets_);
-  for (int i = 0; i < numExamples; i++) {
-    F[i] = f0;
+  // Every pass over the examples is split into fixed chunks, and losses
+  // are summed per chunk and then in chunk order, so that the totals don't
+  // depend on the number of threads
+  const int numChunks = (numExamples + EVAL_CHUNK_SIZE - 1) / EVAL_CHUNK_SIZE;
+  vector<double> chunkLoss(numChunks, 0.0);
+  auto sumChunks = [](const vector<double>& losses) {
+    double sum = 0.0;
+    for (double loss : losses) {
+      sum += loss;
+    }
+    return sum;
+  };
+
+  // F0 from the statistics of the targets, taken per chunk and summed in
+  // chunk order, then over the ranks, followed by their number
+  const int numStats = fun_.getNumStats();
+  vector<double> chunkStats(static_cast<size_t>(numChunks) * numStats, 0.0);
+  Concurrency::parallelFor(
+    0, numExamples, EVAL_CHUNK_SIZE, [&](int begin, int end) {
+      fun_.addF0Stats(targets, begin, end,
+                      &chunkStats[(begin / EVAL_CHUNK_SIZE) * numStats]);
+    });
+  vector<double> stats(numStats + 1, 0.0);
+  for (int c = 0; c < numChunks; c++) {
+    for (int k = 0; k < numStats; k++) {
+      stats[k] += chunkStats[c * numStats + k];
+    }
   }
+  stats.back() = numExamples;
+  Comm::allreduceSum(stats.data(), stats.size());
+  const double f0 = fun_.getF0FromStats(stats.data());
+  const double totalExamples = stats.back();  // over all the ranks
+  Concurrency::parallelFor(
+    0, numExamples, EVAL_CHUNK_SIZE, [&](int begin, int end) {
+      std::fill(F.get() + begin, F.get() + end, f0);
+      chunkLoss[begin / EVAL_CHUNK_SIZE] =
+        fun_.getLoss(targets, F.get(), begin, end);
+    });
 
+  const size_t modelBegin = model->size();
   model->push_back(new LeafNode<double>(f0));
 
-  double initLoss = fun_.getInitLoss(ds_.targets_);
+  double initLoss = sumChunks(chunkLoss);
+  Comm::allreduceSum(&initLoss, 1);
+
+  LOG(INFO) << "init avg loss " << initLoss / totalExamples;
+
+  // Scores of the validation examples, kept up to date one tree at a time,
+  // and the number of trees (and their fimps) with the lowest loss on them
+  const int numValid = validation ? validation->getNumExamples() : 0;
+  const double* validTargets =
+    validation ? validation->targets_.data() : NULL;
+  vector<double> validF(numValid, f0);
+  vector<double> validChunkLoss(
+    (numValid + EVAL_CHUNK_SIZE - 1) / EVAL_CHUNK_SIZE, 0.0);
+  double totalValid = numValid;
+  double bestValidLoss = 0.0;
+  int bestNumTrees = 0;
+  vector<double> bestFimps(fimps, fimps + ds_.numFeatures_);
+  if (validation != NULL) {
+    Concurrency::parallelFor(
+      0, numValid, EVAL_CHUNK_SIZE, [&](int begin, int end) {
+        validChunkLoss[begin / EVAL_CHUNK_SIZE] =
+          fun_.getLoss(validTargets, validF.data(), begin, end);
+      });
+    double totals[] = {sumChunks(validChunkLoss), totalValid};
+    Comm::allreduceSum(totals, 2);
+    bestValidLoss = totals[0];
+    totalValid = totals[1];
+    LOG(INFO) << "init validation avg loss " << bestValidLoss / totalValid;
+  }
+
+  // Pick up where the last checkpoint left off, if any. All ranks of a
+  // distributed run have to resume from the same tree.
+  string checkpointFile = FLAGS_checkpoint_file;
+  if (Comm::getSize() > 1 && checkpointFile != "") {
+    checkpointFile += "." + to_string(Comm::getRank());
+  }
+  Checkpoint settings;
+  settings.seed = FLAGS_seed;
+  settings.numLeaves = cfg_.getNumLeaves();
+  settings.learningRate = cfg_.getLearningRate();
+  settings.exampleSamplingRate = cfg_.getExampleSamplingRate();
+  settings.featureSamplingRate = cfg_.getFeatureSamplingRate();
+  settings.floatGradients = FLAGS_float_gradients;
+  settings.levelWise = FLAGS_level_wise;
+  settings.featuresPerTree = FLAGS_sample_features_per_tree;
+  settings.minLeafExamples = FLAGS_min_leaf_examples;
+  settings.minBlockExamples = FLAGS_min_block_examples;
+  settings.minGroupExamples = FLAGS_min_group_examples;
+  settings.compactRows = FLAGS_compact_rows;
+  settings.histogramCacheMb = FLAGS_histogram_cache_mb;
+  settings.featureGroupSize = FLAGS_feature_group_size;
+  settings.sparseThreshold = FLAGS_sparse_threshold;
+  for (int fid = 0; fid < ds_.numFeatures_; fid++) {
+    for (double t : ds_.getTransitions(fid)) {
+      uint64_t bits;
+      memcpy(&bits, &t, sizeof(bits));
+      settings.transitionsHash = mixBits(settings.transitionsHash ^ bits);
+    }
+    settings.transitionsHash = mixBits(settings.transitionsHash ^ fid);
+  }
+  for (int i = 0; i < numExamples; i++) {
+    settings.targetSum += targets[i];
+  }
+  int firstTree = 0;
+  if (checkpointFile != "" && ifstream(checkpointFile)) {
+    Checkpoint c;
+    vector<TreeNode<double>*> trees;
+    if (readCheckpoint(checkpointFile, numExamples, ds_.numFeatures_,
+                       numValid, settings, &c, &trees)) {
+      delete model->back();
+      model->pop_back();
+      model->insert(model->end(), trees.begin(), trees.end());
+      copy(c.F.begin(), c.F.end(), F.get());
+      copy(c.fimps.begin(), c.fimps.end(), fimps);
+      validF = c.validF;
+      bestFimps = c.bestFimps;
+      initLoss = c.initLoss;
+      bestValidLoss = c.bestValidLoss;
+      bestNumTrees = c.bestNumTrees;
+      firstTree = c.numTrees;
+      LOG(INFO) << "resuming from " << firstTree << " trees in "
+                << checkpointFile;
+    } else {
+      LOG(WARNING) << "training from scratch, the checkpoints will replace "
+                   << checkpointFile;
+    }
+  }
+  int resumed[] = {firstTree, 1};
+  Comm::allreduceSum(resumed, 2);
+  CHECK(resumed[0] == firstTree * resumed[1])
+    << "ranks resume from different checkpoints";
+
+  // the checkpoint being written in the background, if any
+  thread checkpointWriter;
 
-  LOG(INFO) << "init avg loss " << initLoss / numExamples;
+  // buffers of the trees, reused from one to the next
+  TreeRegressor::Scratch scratch;
 
-  for (int it = 0; it < cfg_.getNumTrees(); it++) {
+  // by worker, the leaves of a chunk of validation examples
+  vector<vector<int>> validLeaves(
+    Concurrency::getNumWorkers(),
+    vector<int>(validation != NULL ? EVAL_CHUNK_SIZE : 0));
+
+  for (int it = firstTree; it < cfg_.getNumTrees(); it++) {
 
     LOG(INFO) << "------- iteration " << it << " -------";
 
-    fun_.getGradient(ds_.targets_, F, y);
-    TreeRegressor regressor(ds_, y, fun_);
+    Stats::startIteration();
+    ScopedTimer iterationTimer("iteration_sec");
+    const double idleStart = Concurrency::getIdleSeconds();
+
+    {
+      ScopedTimer timer("gradient_sec");
+      Concurrency::parallelFor(
+        0, numExamples, EVAL_CHUNK_SIZE, [&](int begin, int end) {
+          fun_.getGradient(targets, F.get(), y.get(), begin, end);
+          if (yf) {
+            for (int i = begin; i < end; i++) {
+              yf[i] = static_cast<float>(y[i]);
+            }
+          }
+        });
+    }
+    TreeRegressor regressor(ds_, y, fun_, it, yf.get(), &scratch);
 
-    std::unique_ptr<TreeNode<uint16_t>> weakModel(
-      regressor.getTree(cfg_.getNumLeaves(), cfg_.getExampleSamplingRate(),
-                        cfg_.getFeatureSamplingRate(), fimps));
+    std::unique_ptr<TreeNode<uint16_t>> weakModel;
+    {
+      ScopedTimer timer("tree_sec");
+      weakModel.reset(
+        regressor.getTree(cfg_.getNumLeaves(), cfg_.getExampleSamplingRate(),
+                          cfg_.getFeatureSamplingRate(), fimps));
+    }
 
     weakModel->scale(cfg_.getLearningRate());
 
     model->push_back(mapTree(weakModel.get()));
 
     VLOG(1) << toPrettyJson(weakModel->toJson());
-    double newLoss = 0.0;
-
-    if (FLAGS_num_threads > 1) {
-      CounterMonitor monitor(FLAGS_num_threads);
-      boost::scoped_array<double> subLoss(new double[FLAGS_num_threads]);
-      for (int wid = 0; wid < FLAGS_num_threads; wid++) {
-        subLoss[wid] = 0.0;
-        Concurrency::threadManager->add(
-          boost::shared_ptr<apache::thrift::concurrency::Runnable>(
-            new ParallelEval(monitor, numExamples, ds_.numFeatures_,
-                             fun_, weakModel,
-                             ds_, ds_.targets_, F, subLoss,
-                             wid, FLAGS_num_threads)));
+
+    // the votes of the leaves, scaled the same way as weakModel
+    vector<double> votes(regressor.getLeafVotes());
+    for (auto& vote : votes) {
+      vote *= cfg_.getLearningRate();
+    }
+
+    if (validation != NULL) {
+      // routed down the same nodes as the examples not sampled for the tree
+      ScopedTimer timer("validation_sec");
+      Concurrency::parallelFor(
+        0, numValid, EVAL_CHUNK_SIZE, [&](int begin, int end) {
+          int* validLeaf = validLeaves[Concurrency::getWorkerId()].data();
+          regressor.getLeafIndex(*validation, begin, end, validLeaf);
+          for (int i = begin; i < end; i++) {
+            validF[i] += votes[validLeaf[i - begin]];
+          }
+          validChunkLoss[begin / EVAL_CHUNK_SIZE] =
+            fun_.getLoss(validTargets, validF.data(), begin, end);
+        });
+      double validLoss = sumChunks(validChunkLoss);
+      Comm::allreduceSum(&validLoss, 1);
+      LOG(INFO) << "validation avg loss " << validLoss / totalValid;
+
+      if (validLoss < bestValidLoss) {
+        bestValidLoss = validLoss;
+        bestNumTrees = it + 1;
+        bestFimps.assign(fimps, fimps + ds_.numFeatures_);
+      } else if (FLAGS_early_stopping_rounds > 0
+                 && it + 1 - bestNumTrees >= FLAGS_early_stopping_rounds) {
+        LOG(INFO) << "early stopping after " << it + 1 << " trees, best: "
+                  << bestNumTrees;
+        break;
       }
-      monitor.wait();
+    }
+
+    // Update F from the leaf every example falls into
+    double newLoss;
+    {
+      ScopedTimer timer("update_sec");
+      regressor.getLeafIndex(&leaf);
+
+      Concurrency::parallelFor(
+        0, numExamples, EVAL_CHUNK_SIZE, [&](int begin, int end) {
+          for (int i = begin; i < end; i++) {
+            F[i] += votes[leaf[i]];
+          }
+          chunkLoss[begin / EVAL_CHUNK_SIZE] =
+            fun_.getLoss(targets, F.get(), begin, end);
+        });
 
-      for (int wid = 0; wid < FLAGS_num_threads; wid++) {
-        newLoss += subLoss[wid];
+      newLoss = sumChunks(chunkLoss);
+      Comm::allreduceSum(&newLoss, 1);
+    }
+    Stats::add("pool_idle_sec", Concurrency::getIdleSeconds() - idleStart);
+
+    LOG(INFO) << "total avg loss " << newLoss/totalExamples
+              << " reduction: " << 1.0 - newLoss/initLoss;
+
+    if (checkpointFile != "" && (it + 1) % FLAGS_checkpoint_every == 0) {
+      // snapshot the state here, write it out while the next trees grow
+      ScopedTimer timer("checkpoint_sec");
+      if (checkpointWriter.joinable()) {
+        checkpointWriter.join();
       }
-    } else {
-      //boost::scoped_array<uint16_t> fvec(new uint16_t[ds_.numFeatures_]);
-      for (int i = 0; i < numExamples; i++) {
-        // ds_.getFeatureVec(i, fvec);
-        // double score = weakModel->eval(fvec);
-        double score = ds_.getPrediction(weakModel.get(), i);
-        F[i] += score;
-        newLoss += fun_.getExampleLoss(ds_.targets_[i], F[i]);
+      shared_ptr<Checkpoint> c(new Checkpoint(settings));
+      c->numTrees = it + 1;
+      c->bestNumTrees = bestNumTrees;
+      c->initLoss = initLoss;
+      c->bestValidLoss = bestValidLoss;
+      c->F.assign(F.get(), F.get() + numExamples);
+      c->fimps.assign(fimps, fimps + ds_.numFeatures_);
+      c->validF = validF;
+      c->bestFimps = bestFimps;
+      ostringstream os;
+      for (size_t i = modelBegin; i < model->size(); i++) {
+        writeTree(os, (*model)[i]);
       }
+      c->model = os.str();
+      // the writer mustn't share worker 0's CPU, which it would inherit
+      Concurrency::unpinCaller();
+      checkpointWriter = thread([c, checkpointFile]() {
+          writeCheckpoint(checkpointFile, *c);
+        });
+      Concurrency::pinCaller();
     }
+  }
+  if (checkpointWriter.joinable()) {
+    checkpointWriter.join();
+  }
+  Concurrency::unpinCaller();
 
-    LOG(INFO) << "total avg loss " << newLoss/numExamples
-              << " reduction: " << 1.0 - newLoss/initLoss;
+  if (validation != NULL) {
+    Stats::set("best_num_trees", bestNumTrees);
+  }
+  if (validation != NULL && FLAGS_early_stopping_rounds > 0) {
+    // drop the trees after the best one
+    const size_t modelEnd = modelBegin + 1 + bestNumTrees;
+    for (size_t i = modelEnd; i < model->size(); i++) {
+      delete (*model)[i];
+    }
+    model->resize(modelEnd);
+    copy(bestFimps.begin(), bestFimps.end(), fimps);
   }
 }
 
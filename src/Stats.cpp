@@ -0,0 +1,73 @@
+#include "Stats.h"
+
+#include <fstream>
+#include <sys/resource.h>
+
+#include "folly/json.h"
+#include "glog/logging.h"
+
+namespace boosting {
+
+using namespace std;
+
+mutex Stats::mutex_;
+map<string, double> Stats::totals_;
+vector<map<string, double>> Stats::iterations_;
+
+void Stats::add(const string& name, double value) {
+  lock_guard<mutex> lock(mutex_);
+  totals_[name] += value;
+  if (!iterations_.empty()) {
+    iterations_.back()[name] += value;
+  }
+}
+
+void Stats::set(const string& name, double value) {
+  lock_guard<mutex> lock(mutex_);
+  totals_[name] = value;
+}
+
+void Stats::startIteration() {
+  lock_guard<mutex> lock(mutex_);
+  iterations_.emplace_back();
+}
+
+double Stats::getPeakRssMb() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0.0;
+  }
+  return usage.ru_maxrss / 1024.0;  // in KB on Linux
+}
+
+bool Stats::write(const string& fileName) {
+  lock_guard<mutex> lock(mutex_);
+
+  folly::dynamic totals = folly::dynamic::object;
+  for (const auto& counter : totals_) {
+    totals.insert(counter.first, counter.second);
+  }
+  folly::dynamic iterations = {};
+  for (const auto& counters : iterations_) {
+    folly::dynamic it = folly::dynamic::object;
+    for (const auto& counter : counters) {
+      it.insert(counter.first, counter.second);
+    }
+    iterations.push_back(it);
+  }
+
+  folly::dynamic stats = folly::dynamic::object;
+  stats.insert("totals", totals);
+  stats.insert("iterations", iterations);
+
+  ofstream fs(fileName);
+  fs << toPrettyJson(stats);
+  fs.close();
+  if (!fs) {
+    LOG(ERROR) << "fail to write stats file: " << fileName;
+    return false;
+  }
+  return true;
+}
+
+}
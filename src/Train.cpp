@@ -1,24 +1,27 @@
 #include <algorithm>
+#include <atomic>
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
+#include <sys/stat.h>
+#include <thread>
 #include <vector>
 
-#include "boost/make_shared.hpp"
-#include "boost/shared_ptr.hpp"
+#include "Comm.h"
 #include "Concurrency.h"
 #include "Config.h"
 #include "GbmFun.h"
 #include "Gbm.h"
 #include "DataSet.h"
+#include "Forest.h"
+#include "Stats.h"
 #include "Tree.h"
 #include "gflags/gflags.h"
 #include "folly/String.h"
 #include "folly/json.h"
-#include "thrift/concurrency/PosixThreadFactory.h"
-#include "thrift/concurrency/Thread.h"
-#include "thrift/concurrency/ThreadManager.h"
 
 using namespace boosting;
 using namespace std;
@@ -35,12 +38,24 @@ DEFINE_string(training_files, "",
 DEFINE_string(testing_files, "",
               "comma separated list of data files for testing");
 
+DEFINE_string(validation_files, "",
+              "comma separated list of data files scored after every tree "
+              "during training (see --early_stopping_rounds)");
+
 DEFINE_string(model_file, "",
               "file contains the whole model");
 
 DEFINE_bool(eval_only, false,
             "eval only mode");
 
+DEFINE_bool(binary_model, true,
+            "also write the model in binary form to <model_file>.bin, "
+            "which --eval_only then maps instead of parsing the Json");
+
+DEFINE_string(code_file, "",
+              "if set, also write the model as C++ source to this file, "
+              "with a double predict(const double* fvec) entry point");
+
 DEFINE_bool(find_optimal_num_trees, false,
             "using huge data to trim number of trees");
 
@@ -48,126 +63,246 @@ DEFINE_int32(num_examples_for_training, -1,
              "number of data points used for training, "
              " -1 will use all available");
 
+DEFINE_string(data_cache_file, "",
+              "binary cache of the bucketized training data: loaded instead "
+              "of the training files if it exists, otherwise written after "
+              "loading them");
+
 const int CHUNK_SIZE = 2500;  // # of lines each data loading chunk may parse
+const int TEST_BLOCK_SIZE = 1 << 14;  // # of testing lines read at a time
+const int SCORE_CHUNK_SIZE = 256;     // # of testing rows scored together
 
 /**
- * Utility class used to parallelize dataset loading.
+ * Utility class used to parallelize dataset loading. Chunks are recycled
+ * through the loading pipeline, so their buffers are reused.
  */
-class DataChunk : public apache::thrift::concurrency::Runnable {
+class DataChunk {
 
  public:
 
-  DataChunk(const Config& cfg, const DataSet& dataSet,
-            CounterMonitor* monitorPtr = NULL) :
-      cfg_(cfg), dataSet_(dataSet), monitorPtr_(monitorPtr) {}
+  DataChunk(const Config& cfg, const DataSet& dataSet) :
+      cfg_(cfg), dataSet_(dataSet), seq_(0), numLines_(0), numRows_(0) {}
 
-  bool addLine(const string& s) {
-    if (s.empty()) {
-      return false;
+  // Read up to chunkSize non empty lines, false if there were none left
+  bool readLines(istream& in, size_t chunkSize, int seq) {
+    seq_ = seq;
+    numLines_ = 0;
+    if (lines_.size() < chunkSize) {
+      lines_.resize(chunkSize);
     }
-    lines_.emplace_back(s);
-    return true;
-  }
-
-  void parseLines() {
-    featureVectors_.reserve(lines_.size());
-    targets_.reserve(lines_.size());
-    boost::scoped_array<double> farr(new double[cfg_.getNumFeatures()]);
-    double target;
-    for (const string& line : lines_) {
-      if (dataSet_.getRow(line, &target, farr)) {
-        targets_.push_back(target);
-        featureVectors_.emplace_back(farr.get(),
-                                     farr.get() + cfg_.getNumFeatures());
+    while (numLines_ < chunkSize && getline(in, lines_[numLines_])) {
+      if (!lines_[numLines_].empty()) {
+        numLines_++;
       }
     }
+    return numLines_ > 0;
   }
 
-  void run() {
-    parseLines();
-    if (monitorPtr_ != NULL) {
-      monitorPtr_->decrement();
+  void parseLines() {
+    const int numFeatures = cfg_.getNumFeatures();
+    featureVectors_.resize(numLines_ * numFeatures);
+    targets_.resize(numLines_);
+    numRows_ = 0;
+    for (size_t i = 0; i < numLines_; i++) {
+      const string& line = lines_[i];
+      if (dataSet_.getRow(line.data(), line.data() + line.size(),
+                          &targets_[numRows_],
+                          &featureVectors_[numRows_ * numFeatures])) {
+        numRows_++;
+      }
     }
   }
 
-  const vector<vector<double>>& getFeatureVectors() const {
-    return featureVectors_;
-  }
-
-  const vector<double>& getTargets() const {
-    return targets_;
-  }
-
-  size_t getLineBufferSize() const {
-    return lines_.size();
+  int getSequence() const {
+    return seq_;
   }
 
   size_t getSize() const {
-    return featureVectors_.size();
+    return numRows_;
   }
 
   // Does not use class member dataset, since we might want to load into
   // another dataset.
   size_t addToDataSet(DataSet* dataSet) const {
-    CHECK(featureVectors_.size() == targets_.size())
-      << "featureVectors_ and targets_ vectors must be the same size";
-    boost::scoped_array<double> farr(new double[cfg_.getNumFeatures()]);
-    size_t size = featureVectors_.size();
-    for (size_t i = 0; i < size; ++i) {
-      const auto fvec = featureVectors_[i];
-      copy(fvec.begin(), fvec.end(), farr.get());
-      if (!dataSet->addVector(farr, targets_[i])) {
+    const int numFeatures = cfg_.getNumFeatures();
+    for (size_t i = 0; i < numRows_; ++i) {
+      if (!dataSet->addVector(&featureVectors_[i * numFeatures],
+                              targets_[i])) {
         return i;
       }
     }
-    return size;
+    return numRows_;
   }
 
  private:
 
   const Config& cfg_;
   const DataSet& dataSet_;
-  CounterMonitor* monitorPtr_;  // for threading purposes
+  int seq_;                        // position of the chunk in the file
   vector<string> lines_;
-  vector<vector<double>> featureVectors_;
+  size_t numLines_;
+  vector<double> featureVectors_;  // row major, numRows_ rows
   vector<double> targets_;
+  size_t numRows_;
 
 };
 
-// Divide training data file's lines into chunks,
-// and parse chunks concurrently if desired/possible
-void readIntoDataChunks(istream& in,
-                        vector<boost::shared_ptr<DataChunk>>* chunks,
-                        size_t chunkSize, const Config& cfg,
-                        const DataSet& dataSet) {
-  // Read lines, placing them into chunks
-  CounterMonitor monitor(0);
-  boost::shared_ptr<DataChunk> curChunkPtr =
-    boost::make_shared<DataChunk>(cfg, dataSet, &monitor);
-  string line;
-  while (getline(in, line)) {
-    curChunkPtr->addLine(line);
-    if (curChunkPtr->getLineBufferSize() >= chunkSize) {
-      // filled up current chunk, so start another one
-      chunks->push_back(curChunkPtr);
-      curChunkPtr = boost::make_shared<DataChunk>(cfg, dataSet, &monitor);
+// Load a data file through a pipeline: a reader thread fills chunks with
+// lines, parser threads parse them, and the calling thread adds them to the
+// data set in file order. The stages run concurrently and only a fixed set
+// of chunks is ever allocated, which bounds memory use: the reader waits
+// for a chunk to be recycled once they are all in flight. The parsers are
+// plain threads rather than pool workers, so that bucketization on the
+// calling thread can use the pool.
+void loadDataFile(istream& in, const Config& cfg, DataSet* ds) {
+  const int numParsers = Concurrency::getNumWorkers();
+  const int numChunks = 2 * numParsers + 2;
+
+  vector<unique_ptr<DataChunk>> chunks;
+  BlockingQueue<DataChunk*> freeChunks(numChunks);
+  BlockingQueue<DataChunk*> parseQueue(numChunks);
+  BlockingQueue<DataChunk*> ingestQueue(numChunks);
+  for (int i = 0; i < numChunks; i++) {
+    chunks.emplace_back(new DataChunk(cfg, *ds));
+    freeChunks.push(chunks.back().get());
+  }
+
+  atomic<bool> stopReading(false);
+  thread reader([&] {
+      DataChunk* chunk;
+      int seq = 0;
+      while (!stopReading && freeChunks.pop(&chunk)
+             && chunk->readLines(in, CHUNK_SIZE, seq)) {
+        parseQueue.push(chunk);
+        seq++;
+      }
+      parseQueue.close();
+    });
+
+  atomic<int> activeParsers(numParsers);
+  vector<thread> parsers;
+  for (int i = 0; i < numParsers; i++) {
+    parsers.emplace_back([&] {
+        DataChunk* chunk;
+        while (parseQueue.pop(&chunk)) {
+          chunk->parseLines();
+          ingestQueue.push(chunk);
+        }
+        if (--activeParsers == 0) {
+          ingestQueue.close();
+        }
+      });
+  }
+
+  // chunks come out of the parsers in any order, hold on to the ones that
+  // are early
+  map<int, DataChunk*> parsed;
+  int next = 0;
+  DataChunk* chunk;
+  while (ingestQueue.pop(&chunk)) {
+    parsed[chunk->getSequence()] = chunk;
+    for (auto it = parsed.begin();
+         it != parsed.end() && it->first == next;
+         it = parsed.erase(it), next++) {
+      if (!stopReading
+          && it->second->addToDataSet(ds) < it->second->getSize()) {
+        // the data set is full, skip the rest of the file
+        stopReading = true;
+      }
+      freeChunks.push(it->second);
     }
   }
-  if (curChunkPtr->getLineBufferSize() > 0) {
-    chunks->push_back(curChunkPtr);
+
+  reader.join();
+  for (auto& parser : parsers) {
+    parser.join();
+  }
+}
+
+// Losses and counters accumulated over testing data
+struct TestStats {
+
+  explicit TestStats(int numTrees)
+    : funs(numTrees), agreeCount(0), skipCount(0), sumy(0.0), sumy2(0.0) {}
+
+  void merge(const TestStats& other) {
+    fun.merge(other.fun);
+    for (int i = 0; i < funs.size(); i++) {
+      funs[i].merge(other.funs[i]);
+    }
+    agreeCount += other.agreeCount;
+    skipCount += other.skipCount;
+    sumy += other.sumy;
+    sumy2 += other.sumy2;
   }
 
-  // Parse all chunks
-  if (FLAGS_num_threads > 0 && !chunks->empty()) {
-    monitor.init(chunks->size());                 
-    for (auto chunkPtr : *chunks) {               
-      Concurrency::threadManager->add(chunkPtr);  
-    }                                             
-    monitor.wait();                               
-  } else {                                        
-    for (auto chunkPtr : *chunks) {               
-      chunkPtr->parseLines();                     
-    }                                             
+  LeastSquareFun fun;           // loss of the whole model
+  vector<LeastSquareFun> funs;  // loss of the first i + 1 trees
+  int agreeCount;               // # of scores matching the logged ones
+  int skipCount;                // # of malformed rows, left out of the rest
+  double sumy;
+  double sumy2;
+};
+
+// Parse and score lines[0, numLines) in parallel. Each chunk of rows is
+// pushed through the forest one tree at a time, and the per chunk stats
+// are merged into stats in line order, so results don't depend on the
+// number of threads.
+void scoreLines(const vector<string>& lines, int numLines,
+                const Config& cfg, const DataSet& ds,
+                const Forest<double>& forest, TestStats* stats) {
+  const int numFeatures = cfg.getNumFeatures();
+  const int numTrees = forest.getNumTrees();
+  const int numChunks = (numLines + SCORE_CHUNK_SIZE - 1) / SCORE_CHUNK_SIZE;
+  vector<TestStats> chunkStats(numChunks, TestStats(stats->funs.size()));
+
+  Concurrency::parallelFor(0, numChunks, 1, [&](int cbegin, int cend) {
+      vector<double> rows(SCORE_CHUNK_SIZE * numFeatures);
+      vector<double> targets(SCORE_CHUNK_SIZE);
+      vector<double> cmpScores(SCORE_CHUNK_SIZE);
+      vector<double> scores(SCORE_CHUNK_SIZE);
+      vector<int> nodes(SCORE_CHUNK_SIZE);
+
+      for (int c = cbegin; c < cend; c++) {
+        TestStats& st = chunkStats[c];
+        const int end = std::min((c + 1) * SCORE_CHUNK_SIZE, numLines);
+        int numRows = 0;
+        for (int i = c * SCORE_CHUNK_SIZE; i < end; i++) {
+          const string& line = lines[i];
+          cmpScores[numRows] = 0.0;
+          if (ds.getRow(line.data(), line.data() + line.size(),
+                        &targets[numRows], &rows[numRows * numFeatures],
+                        &cmpScores[numRows])) {
+            numRows++;
+          } else {
+            st.skipCount++;
+          }
+        }
+
+        fill(scores.begin(), scores.end(), 0.0);
+        for (int tid = 0; tid < numTrees; tid++) {
+          forest.addTreeScores(tid, rows.data(), numRows, numFeatures,
+                               scores.data(), nodes.data());
+          if (!st.funs.empty()) {
+            for (int r = 0; r < numRows; r++) {
+              st.funs[tid].accumulateExampleLoss(targets[r], scores[r]);
+            }
+          }
+        }
+
+        for (int r = 0; r < numRows; r++) {
+          st.fun.accumulateExampleLoss(targets[r], scores[r]);
+          if (fabs(cmpScores[r] - scores[r]) <= 1e-5) {
+            st.agreeCount++;
+          }
+          st.sumy += targets[r];
+          st.sumy2 += targets[r] * targets[r];
+        }
+      }
+    });
+
+  for (const auto& st : chunkStats) {
+    stats->merge(st);
   }
 }
 
@@ -210,7 +345,7 @@ int main(int argc, char **argv) {
   google::SetUsageMessage("Gbm Training");
   google::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
-  Concurrency::initThreadManager();
+  Concurrency::initThreadPool();
 
   LOG(INFO) << ss.str();
 
@@ -222,36 +357,83 @@ int main(int argc, char **argv) {
   CHECK(cfg.readConfig(FLAGS_config_file));
 
   vector<TreeNode<double>*> model;
+  unique_ptr<Forest<double>> forest;
   DataSet ds(cfg, FLAGS_num_examples_for_bucketing,
              FLAGS_num_examples_for_training);
 
   if (!FLAGS_eval_only) {
-    // Compute model from training files
+    // Compute model from training files, each rank of a distributed run
+    // from its own shard
+    Comm::init();
+    CHECK(Comm::getSize() == 1 || FLAGS_data_cache_file == "")
+      << "no data cache in distributed training";
+
+    // First, load training files, or their cached bucketized form
+    if (FLAGS_data_cache_file != "" && ifstream(FLAGS_data_cache_file)) {
+      LOG(INFO) << "loading data from cache:" << FLAGS_data_cache_file;
+      ScopedTimer timer("load_sec");
+      CHECK(ds.load(FLAGS_data_cache_file));
+      Stats::set("peak_rss_after_loading_mb", Stats::getPeakRssMb());
+    } else {
+      if (Comm::getSize() > 1) {
+        // buckets have to mean the same on every rank: found over the
+        // values of all of them
+        ds.shareTransitions();
+      }
 
-    // First, load training files
-    vector<folly::StringPiece> sv;
-    folly::split(',', FLAGS_training_files, sv);
+      vector<folly::StringPiece> sv;
+      folly::split(',', FLAGS_training_files, sv);
 
-    time_t start, end;
-    time(&start);
+      time_t start, end;
+      time(&start);
 
-    for (const auto& s : sv) {
-      LOG(INFO) << "loading data from:" << s;
+      for (const auto& s : sv) {
+        LOG(INFO) << "loading data from:" << s;
 
-      ifstream fs(s.str());
-      vector<boost::shared_ptr<DataChunk>> dataChunks;
-      readIntoDataChunks(fs, &dataChunks, CHUNK_SIZE, cfg, ds);
-      for (const auto chunkPtr : dataChunks) {
-        chunkPtr->addToDataSet(&ds);
+        ScopedTimer timer("load_sec");
+        ifstream fs(s.str());
+        loadDataFile(fs, cfg, &ds);
+
+        time(&end);
+        double timespent = difftime(end, start);
+        LOG(INFO) << "read " << ds.getNumExamples() << " examples in "
+                  << timespent << " sec" << endl;
       }
 
-      time(&end);
-      double timespent = difftime(end, start);
-      LOG(INFO) << "read " << ds.getNumExamples() << " examples in "
-                << timespent << " sec" << endl;
+      Stats::set("peak_rss_after_loading_mb", Stats::getPeakRssMb());
+
+      {
+        ScopedTimer timer("bucketize_sec");
+        ds.close();
+      }
+      Stats::set("peak_rss_after_bucketization_mb", Stats::getPeakRssMb());
+      if (FLAGS_data_cache_file != "") {
+        CHECK(ds.save(FLAGS_data_cache_file));
+      }
     }
 
-    ds.close();
+    // Validation data, bucketized the same way as the training data
+    unique_ptr<DataSet> validation;
+    if (FLAGS_validation_files != "") {
+      ScopedTimer timer("validation_load_sec");
+      validation.reset(new DataSet(cfg, FLAGS_num_examples_for_bucketing));
+      vector<vector<double>> transitions(cfg.getNumFeatures());
+      for (int fid = 0; fid < cfg.getNumFeatures(); fid++) {
+        transitions[fid] = ds.getTransitions(fid);
+      }
+      validation->setTransitions(transitions);
+
+      vector<folly::StringPiece> vsv;
+      folly::split(',', FLAGS_validation_files, vsv);
+      for (const auto& s : vsv) {
+        LOG(INFO) << "loading validation data from:" << s;
+        ifstream fs(s.str());
+        loadDataFile(fs, cfg, validation.get());
+      }
+      validation->close();
+      LOG(INFO) << "read " << validation->getNumExamples()
+                << " validation examples";
+    }
 
     // Second, train the models
     Gbm engine(fun, ds, cfg);
@@ -259,36 +441,67 @@ int main(int argc, char **argv) {
     for (int i = 0; i < cfg.getNumFeatures(); i++) {
       fimps[i] = 0.0;
     }
-    engine.getModel(&model, fimps);
+    {
+      ScopedTimer timer("training_sec");
+      engine.getModel(&model, fimps, validation.get());
+    }
+    Stats::set("examples", ds.getNumExamples());
+    Stats::set("threads", Concurrency::getNumWorkers());
+    Stats::set("peak_rss_mb", Stats::getPeakRssMb());
+
+    // every rank has the same model, rank 0 writes it out
+    if (Comm::getRank() > 0) {
+      return 0;
+    }
 
     // Third, write the model files
     dumpFimps(FLAGS_model_file + ".fimps", cfg, fimps);
+    Stats::write(FLAGS_model_file + ".stats");
     dumpModel(FLAGS_model_file, model);
+    forest.reset(new Forest<double>(model));
+    if (FLAGS_binary_model) {
+      CHECK(forest->save(FLAGS_model_file + ".bin", cfg.getNumFeatures()));
+    }
   } else {
-    // Skip training, load previously written model
-
-    LOG(INFO) << "loading model from " << FLAGS_model_file;
-    ifstream fs(FLAGS_model_file);
-    stringstream buffer;
-    buffer << fs.rdbuf();
-
-    const folly::dynamic obj = folly::parseJson(buffer.str());
-    const int numTrees = obj["trees"].size();
-    LOG(INFO) << "num trees: " << numTrees;
-    model.reserve(numTrees);
-    for (int i = 0; i < numTrees; i++) {
-      model.push_back(fromJson<double>(obj["trees"][i]));
+    // Skip training, load previously written model, the binary form if
+    // there is one at least as recent as the Json
+    const string binaryFile = FLAGS_model_file + ".bin";
+    struct stat jsonStat, binaryStat;
+    if (FLAGS_binary_model && stat(binaryFile.c_str(), &binaryStat) == 0
+        && (stat(FLAGS_model_file.c_str(), &jsonStat) != 0
+            || binaryStat.st_mtime >= jsonStat.st_mtime)) {
+      LOG(INFO) << "loading model from " << binaryFile;
+      forest.reset(new Forest<double>());
+      if (!forest->load(binaryFile, cfg.getNumFeatures())) {
+        forest.reset();
+      }
+    }
+
+    if (!forest) {
+      LOG(INFO) << "loading model from " << FLAGS_model_file;
+      ifstream fs(FLAGS_model_file);
+      stringstream buffer;
+      buffer << fs.rdbuf();
+
+      const folly::dynamic obj = folly::parseJson(buffer.str());
+      forest.reset(new Forest<double>(obj));
     }
+    LOG(INFO) << "num trees: " << forest->getNumTrees();
+  }
+
+  if (FLAGS_code_file != "") {
+    ofstream fs(FLAGS_code_file);
+    forest->writeCode(fs);
+    fs.close();
+    CHECK(fs) << "fail to write " << FLAGS_code_file;
   }
 
   if (FLAGS_testing_files != "") {
     // See how well the model performs on testing data
 
-    double target, score;
-    boost::scoped_array<double> fvec(new double[cfg.getNumFeatures()]);
-    int agreeCount = 0;
-    double sumy = 0.0, sumy2 = 0.0;
-    vector<LeastSquareFun> funs(model.size());
+    const int numTrees = forest->getNumTrees();
+    TestStats stats(FLAGS_find_optimal_num_trees ? numTrees : 0);
+    vector<string> lines(TEST_BLOCK_SIZE);
 
     vector<folly::StringPiece> tsv;
     folly::split(',', FLAGS_testing_files, tsv);
@@ -303,43 +516,33 @@ int main(int argc, char **argv) {
         fs.open(s.str());
         is = &fs;
       }
-      string line;
-      vector<double> scores;
-      while(getline(*is, line)) {
-        ds.getRow(line, &target, fvec, &score);
-        sumy += target;
-        sumy2 += target * target;
-        double f;
-        if (FLAGS_find_optimal_num_trees) {
-          f = predict_vec(model, fvec, &scores);
-          for (int i = 0; i < model.size(); i++) {
-            funs[i].accumulateExampleLoss(target, scores[i]);
-          }
-          scores.clear();
-        } else {
-          f = predict(model, fvec);
-        }
 
-        fun.accumulateExampleLoss(target, f);
-        if (fabs(score - f) <= 1e-5) {
-          agreeCount++;
+      // read a block of lines, then parse and score it in parallel
+      int numLines = 0;
+      while (true) {
+        const bool more = static_cast<bool>(getline(*is, lines[numLines]));
+        if (more) {
+          numLines++;
         }
-
-        if (fun.getNumExamples() % 1000 == 0) {
-          LOG(INFO) << "test loss reduction: " << fun.getReduction()
-                    << " on num examples: " << fun.getNumExamples()
-                    << " total loss: " << fun.getLoss()
-                    << " logged score: " << score
-                    << " computed score: " << f;
+        if (numLines == TEST_BLOCK_SIZE || (!more && numLines > 0)) {
+          scoreLines(lines, numLines, cfg, ds, *forest, &stats);
+          numLines = 0;
+          LOG(INFO) << "test loss reduction: " << stats.fun.getReduction()
+                    << " on num examples: " << stats.fun.getNumExamples()
+                    << " total loss: " << stats.fun.getLoss();
+        }
+        if (!more) {
+          break;
         }
       }
     }
+    fun = stats.fun;
 
     if (FLAGS_find_optimal_num_trees) {
         cout << "Optimal num tree stats:\t";
-      cout << model.size() << '\t';
-      for (int i = 0; i < model.size(); i++) {
-        cout << funs[i].getLoss() << '\t';
+      cout << numTrees << '\t';
+      for (int i = 0; i < numTrees; i++) {
+        cout << stats.funs[i].getLoss() << '\t';
       }
       cout << endl;
     }
@@ -347,11 +550,15 @@ int main(int argc, char **argv) {
 
     cout << "Avg loss on test: " << fun.getLoss() / fun.getNumExamples() << endl;
     cout << fun.getNumExamples() << '\t' << fun.getReduction() << '\t'
-         << fun.getLoss() << '\t' << sumy << '\t' << sumy2
-         << '\t' << agreeCount << endl;
+         << fun.getLoss() << '\t' << stats.sumy << '\t' << stats.sumy2
+         << '\t' << stats.agreeCount << endl;
 
     LOG(INFO) << "test loss reduction: " << fun.getReduction()
               << " on num examples: " << fun.getNumExamples();
+    if (stats.skipCount > 0) {
+      LOG(WARNING) << "skipped " << stats.skipCount
+                   << " malformed testing rows";
+    }
   }
 
 }
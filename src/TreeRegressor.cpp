@@ -1,12 +1,17 @@
 #include "TreeRegressor.h"
 
-#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iterator>
 #include <limits>
-#include <boost/random/uniform_real.hpp>
 
+#include "Comm.h"
 #include "Concurrency.h"
 #include "GbmFun.h"
 #include "DataSet.h"
+#include "Random.h"
+#include "Stats.h"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 #include "Tree.h"
@@ -14,126 +19,445 @@
 DEFINE_int32(min_leaf_examples, 256,
         "minimum number of data points in the leaf");
 
+DEFINE_int32(min_block_examples, 1 << 16,
+        "minimum number of data points in a block of rows that is built "
+        "into its own partial histogram");
+
+DEFINE_int32(seed, 0,
+        "seed of the random sampling of examples and features");
+
+DEFINE_int32(min_group_examples, 1 << 18,
+        "minimum number of data points in a node for building the "
+        "histograms of grouped features from their row major bins");
+
+DEFINE_bool(compact_rows, false,
+        "gather the bins and gradients of the sampled examples of every "
+        "tree into dense buffers before growing it, so that histogram "
+        "scans read contiguous memory");
+
+DEFINE_bool(level_wise, false,
+        "grow trees a level at a time, splitting every node of a level "
+        "that has a gain (within num_leaves), instead of always the "
+        "leaf with the most gain; the histograms of a level are built "
+        "in a single pass over the rows, routed by a per-row node id");
+
+DEFINE_bool(sample_features_per_tree, false,
+        "draw the sampling of features once per tree instead of once per "
+        "split, so that the histograms of every larger child can be "
+        "derived from its parent's");
+
+DEFINE_int32(histogram_cache_mb, 4096,
+        "memory budget for histograms kept on frontier nodes for "
+        "histogram subtraction, together with the free ones kept for "
+        "reuse");
+
 namespace boosting {
 
 using namespace std;
 
-class ParallelBestSplit : public apache::thrift::concurrency::Runnable {
-    public: 
-        struct ParallelSplitState {
-            int bestFid, bestFv; 
-            double bestGain;
-            ParallelSplitState() {
-                bestFid = 0; bestFv = 0; bestGain = 0;
-            }
-        };
-    private:
-        CounterMonitor& monitor;
-        TreeRegressor& regressor;
-        ParallelSplitState& state;
-        int workerId, numWorkers;
-        const double totalSum;
-        const vector<int>* subset;
-        const double featureSamplingRate;
-        const DataSet& ds;
-    public:
-        ParallelBestSplit(
-                CounterMonitor& monitor_,
-                TreeRegressor& regressor_,
-                ParallelSplitState& state_,
-                int workerId_,
-                int numWorkers_,
-                const double totalSum_,
-                const vector<int>* subset_,
-                const double featureSamplingRate_,
-                const DataSet& ds_): 
-            monitor(monitor_),
-            regressor(regressor_),
-            state(state_),
-            workerId(workerId_),
-            numWorkers(numWorkers_),
-            totalSum(totalSum_),
-            subset(subset_),
-            featureSamplingRate(featureSamplingRate_),
-            ds(ds_) {
-        };
-
-        void run() {
-            for (int fid = 0; fid < ds.numFeatures_; fid++) {
-                if (fid % numWorkers != workerId) continue;
-
-                const auto& f = ds.features_[fid];
-
-                if (f.encoding == EMPTY || !biasedCoinFlip(featureSamplingRate)) {
-                    continue;
-                }
-
-                TreeRegressor::Histogram hist(f.transitions.size() + 1, subset->size(), totalSum);
-
-                if (f.encoding == BYTE) {
-                    regressor.buildHistogram<uint8_t>(*subset, *(f.bvec), hist);
-                } else {
-                    CHECK(f.encoding == SHORT);
-                    regressor.buildHistogram<uint16_t>(*subset, *(f.svec), hist);
-                }
-
-                int fv;
-                double gain;
-                regressor.getBestSplitFromHistogram(hist, &fv, &gain);
-
-                if (gain > state.bestGain) {
-                    state.bestFid = fid;
-                    state.bestFv = fv;
-                    state.bestGain = gain;
-                }
-            }
-            monitor.decrement();
-        };
-};
+// node coordinate of the random draws sampling the examples of a tree;
+// feature samplings use the index of the split instead
+const uint64_t EXAMPLE_SAMPLING = ~0ULL;
 
-// Return true with approximately the desired probability;
-// actual probability may differ by ~ 1/RAND_MAX
-// Not thread safe. But:
-// (1) we're only using this to sample some examples and features,
-//     so we don't care (?)
-// (2) currently TreeRegressor isn't multithreading anyway
-inline bool biasedCoinFlip(double probabilityOfTrue) {
-  return (rand() < probabilityOfTrue * RAND_MAX);
+// number of examples per task of the parallel example sampling
+const int SAMPLING_CHUNK_SIZE = 1 << 16;
+
+// number of histograms a worker takes from the shared free list at once
+const size_t FREE_LIST_BATCH = 16;
+
+// histograms of up to 1 << c buckets are in size class c, for bins of up
+// to 16 bits
+const int NUM_SIZE_CLASSES = 17;
+
+static int getSizeClass(int n) {
+  int c = 0;
+  while ((1 << c) < n) {
+    c++;
+  }
+  CHECK(c < NUM_SIZE_CLASSES);
+  return c;
 }
 
-TreeRegressor::SplitNode::SplitNode(const vector<int>* st):
-  subset(st), fid(-1), fv(0), gain(0), selected(false),
-  left(NULL), right(NULL) {
+// Resize every vector of v to n elements and empty each of those, keeping
+// the capacity of the ones already there
+template<class T>
+static void resetEach(vector<vector<T>>* v, size_t n) {
+  v->resize(n);
+  for (auto& inner : *v) {
+    inner.clear();
+  }
+}
+
+TreeRegressor::SplitNode::SplitNode(int b, int e) {
+  reset(b, e);
+}
+
+void TreeRegressor::SplitNode::reset(int b, int e) {
+  begin = b;
+  end = e;
+  fid = -1;
+  fv = 0;
+  gain = 0;
+  selected = false;
+  leafIdx = -1;
+  totalSum = 0.0;
+  globalCnt = e - b;
+  globalSum = 0.0;
+  left = NULL;
+  right = NULL;
+}
+
+TreeRegressor::Scratch::Scratch() : sharedHists(NUM_SIZE_CLASSES),
+                                     sharedBytes(0), numAllocated(0) {
+}
+
+TreeRegressor::Scratch::~Scratch() {
 }
 
 TreeRegressor::TreeRegressor(
   const DataSet& ds,
   const boost::scoped_array<double>& y,
-  const GbmFun& fun) : ds_(ds), y_(y), fun_(fun) {
+  const GbmFun& fun,
+  int treeId,
+  const float* yf,
+  Scratch* scratch) : ds_(ds), y_(y), fun_(fun), treeId_(treeId),
+                      ownScratch_(scratch == NULL ? new Scratch() : NULL),
+                      scratch_(scratch == NULL ? *ownScratch_ : *scratch),
+                      index_(scratch_.index), buffer_(scratch_.buffer),
+                      features_(ds.features_.get()), groups_(&ds.groups_),
+                      rowY_(yf == NULL ? y.get() : NULL), rowYf_(yf),
+                      rows_(scratch_.rows),
+                      compactFeatures_(scratch_.compactFeatures),
+                      compactGroups_(scratch_.compactGroups),
+                      compactY_(scratch_.compactY),
+                      compactYf_(scratch_.compactYf),
+                      numNodes_(0), root_(NULL), cachedHistBytes_(0),
+                      partitionSec_(0.0) {
+  const int numWorkers = Concurrency::getNumWorkers();
+  scratch_.freeHists.resize(numWorkers);
+  for (auto& freeHists : scratch_.freeHists) {
+    freeHists.resize(NUM_SIZE_CLASSES);
+  }
+  scratch_.groupHists.resize(numWorkers);
+  scratch_.groupOffsets.resize(numWorkers);
 }
 
 TreeRegressor::~TreeRegressor() {
-  for (SplitNode* split : allSplits_) {
-    delete split;
+  // nothing is cached for another tree, so the pool may take it all
+  cachedHistBytes_ = 0;
+  for (size_t i = 0; i < numNodes_; i++) {
+    releaseHistograms(scratch_.nodes[i].get());
+  }
+  Stats::add("histograms_allocated", scratch_.numAllocated.exchange(0));
+}
+
+unique_ptr<TreeRegressor::Histogram> TreeRegressor::newHistogram(
+  int n, int cnt, double sum) const {
+
+  const int c = getSizeClass(n);
+  auto& freeHists = scratch_.freeHists[Concurrency::getWorkerId()][c];
+  if (freeHists.empty()) {
+    lock_guard<mutex> lock(scratch_.sharedMutex);
+    auto& shared = scratch_.sharedHists[c];
+    const size_t batch = min(shared.size(), FREE_LIST_BATCH);
+    for (auto it = shared.end() - batch; it != shared.end(); ++it) {
+      scratch_.sharedBytes -= (*it)->getBytes();
+      freeHists.push_back(std::move(*it));
+    }
+    shared.resize(shared.size() - batch);
+  }
+  if (freeHists.empty()) {
+    scratch_.numAllocated++;
+    unique_ptr<Histogram> hist(new Histogram(n, cnt, sum));
+    hist->cnt.reserve(1 << c);
+    hist->sumy.reserve(1 << c);
+    return hist;
+  }
+  unique_ptr<Histogram> hist = std::move(freeHists.back());
+  freeHists.pop_back();
+  hist->reset(n, cnt, sum);
+  return hist;
+}
+
+void TreeRegressor::recycle(vector<unique_ptr<Histogram>>* hists) const {
+  const size_t budget = static_cast<size_t>(FLAGS_histogram_cache_mb) << 20;
+  lock_guard<mutex> lock(scratch_.sharedMutex);
+  for (auto& hist : *hists) {
+    if (!hist) {
+      continue;
+    }
+    const size_t bytes = hist->getBytes();
+    if (scratch_.sharedBytes + bytes + cachedHistBytes_ <= budget) {
+      scratch_.sharedBytes += bytes;
+      scratch_.sharedHists[getSizeClass(hist->num)].push_back(
+        std::move(hist));
+    }
+  }
+  hists->clear();
+}
+
+void TreeRegressor::releaseHistograms(SplitNode* split) {
+  recycle(&split->hists);
+}
+
+TreeRegressor::SplitNode* TreeRegressor::newNode(int begin, int end) {
+  auto& nodes = scratch_.nodes;
+  if (numNodes_ == nodes.size()) {
+    nodes.emplace_back(new SplitNode(begin, end));
+  } else {
+    nodes[numNodes_]->reset(begin, end);
+  }
+  return nodes[numNodes_++].get();
+}
+
+template<class Y>
+  void TreeRegressor::buildHistogram(const FeatureData& f,
+                                     const int* begin,
+                                     const int* end,
+                                     const Y* y,
+                                     Histogram& hist) const {
+  if (f.encoding == SPARSE) {
+    // the default bucket is left empty, see fillDefaultBin
+    forEachSparse(f, begin, end, [&hist, y](int eid, uint16_t v) {
+        hist.cnt[v] += 1;
+        hist.sumy[v] += y[eid];
+      });
+  } else if (f.encoding == NIBBLE) {
+    buildHistogram(begin, end, NibbleBins(f.bbins), y, hist);
+  } else if (f.encoding == BYTE) {
+    buildHistogram(begin, end, f.bbins, y, hist);
+  } else {
+    CHECK(f.encoding == SHORT);
+    buildHistogram(begin, end, f.sbins, y, hist);
+  }
+}
+
+void TreeRegressor::buildHistogram(const FeatureData& f,
+                                   const int* begin,
+                                   const int* end,
+                                   Histogram& hist) const {
+  if (rowYf_ != NULL) {
+    buildHistogram(f, begin, end, rowYf_, hist);
+  } else {
+    buildHistogram(f, begin, end, rowY_, hist);
+  }
+}
+
+template<class Y>
+  void TreeRegressor::buildGroupHistograms(
+    const FeatureGroup& group,
+    const vector<int>& fids,
+    const int* begin,
+    const int* end,
+    const Y* y,
+    const vector<Histogram*>& hists) const {
+  const int width = group.size();
+  const int num = fids.size();
+  auto& offsets = scratch_.groupOffsets[Concurrency::getWorkerId()];
+  offsets.resize(num);
+  for (int k = 0; k < num; k++) {
+    offsets[k] = ds_.groupOffsets_[fids[k]];
+  }
+
+  for (const int* it = begin; it != end; ++it) {
+    const int id = *it;
+    const double yv = y[id];
+    const uint8_t* row = group.bins.data() + static_cast<size_t>(id) * width;
+    for (int k = 0; k < num; k++) {
+      const int v = row[offsets[k]];
+      hists[k]->cnt[v] += 1;
+      hists[k]->sumy[v] += yv;
+    }
+  }
+}
+
+void TreeRegressor::buildGroupHistograms(
+  const FeatureGroup& group,
+  const vector<int>& fids,
+  const int* begin,
+  const int* end,
+  const vector<Histogram*>& hists) const {
+  if (rowYf_ != NULL) {
+    buildGroupHistograms(group, fids, begin, end, rowYf_, hists);
+  } else {
+    buildGroupHistograms(group, fids, begin, end, rowY_, hists);
+  }
+}
+
+void TreeRegressor::buildLevelHistograms(
+  const FeatureData& f,
+  int begin,
+  int end,
+  const vector<SplitNode*>& scans,
+  const unique_ptr<Histogram>* hists) const {
+  if (f.encoding == SPARSE) {
+    // forEachSparse needs sorted examples, which only the range of a single
+    // node is: go through the part of each one in [begin, end)
+    for (size_t slot = 0; slot < scans.size(); slot++) {
+      const int b = std::max(begin, scans[slot]->begin);
+      const int e = std::min(end, scans[slot]->end);
+      if (b < e && hists[slot]) {
+        buildHistogram(f, index_.data() + b, index_.data() + e,
+                       *hists[slot]);
+      }
+    }
+  } else if (rowYf_ != NULL) {
+    if (f.encoding == NIBBLE) {
+      buildLevelHistograms(begin, end, NibbleBins(f.bbins), rowYf_, hists);
+    } else if (f.encoding == BYTE) {
+      buildLevelHistograms(begin, end, f.bbins, rowYf_, hists);
+    } else {
+      CHECK(f.encoding == SHORT);
+      buildLevelHistograms(begin, end, f.sbins, rowYf_, hists);
+    }
+  } else {
+    if (f.encoding == NIBBLE) {
+      buildLevelHistograms(begin, end, NibbleBins(f.bbins), rowY_, hists);
+    } else if (f.encoding == BYTE) {
+      buildLevelHistograms(begin, end, f.bbins, rowY_, hists);
+    } else {
+      CHECK(f.encoding == SHORT);
+      buildLevelHistograms(begin, end, f.sbins, rowY_, hists);
+    }
+  }
+}
+
+template<class Y>
+  void TreeRegressor::buildLevelGroupHistograms(
+    const FeatureGroup& group,
+    const vector<int>& fids,
+    int begin,
+    int end,
+    const Y* y,
+    const vector<vector<unique_ptr<Histogram>>>& hists,
+    int base) const {
+  const int width = group.size();
+  const int num = fids.size();
+  const int* nodeIds = scratch_.nodeIds.data();
+  const int* offsets = ds_.groupOffsets_.data();
+
+  for (int pos = begin; pos < end; pos++) {
+    const int slot = nodeIds[pos];
+    if (slot < 0) {
+      continue;
+    }
+    const int id = index_[pos];
+    const double yv = y[id];
+    const uint8_t* row = group.bins.data() + static_cast<size_t>(id) * width;
+    for (int k = 0; k < num; k++) {
+      const int fid = fids[k];
+      Histogram* hist = hists[fid][base + slot].get();
+      if (hist == NULL) {
+        continue;
+      }
+      const int v = row[offsets[fid]];
+      hist->cnt[v] += 1;
+      hist->sumy[v] += yv;
+    }
+  }
+}
+
+void TreeRegressor::buildLevelGroupHistograms(
+  const FeatureGroup& group,
+  const vector<int>& fids,
+  int begin,
+  int end,
+  const vector<vector<unique_ptr<Histogram>>>& hists,
+  int base) const {
+  if (rowYf_ != NULL) {
+    buildLevelGroupHistograms(group, fids, begin, end, rowYf_, hists, base);
+  } else {
+    buildLevelGroupHistograms(group, fids, begin, end, rowY_, hists, base);
+  }
+}
+
+int TreeRegressor::getTaskNode(const ScanTask& task) const {
+  return task.group >= 0
+    ? ds_.getGroupNode(task.group) : ds_.getFeatureNode(task.fid);
+}
+
+void TreeRegressor::SplitState::update(int f, int v, double g) {
+  // ties go to the smaller fid, so that the result doesn't depend on which
+  // worker evaluated which feature
+  if (g > gain || (g == gain && g > 0.0 && f < fid)) {
+    fid = f;
+    fv = v;
+    gain = g;
   }
 }
 
-void TreeRegressor::splitExamples(
+unique_ptr<TreeRegressor::Histogram> TreeRegressor::getHistogram(
   const SplitNode& split,
-  vector<int>* left,
-  vector<int>* right) {
+  int fid,
+  const SplitNode* parent,
+  const SplitNode* sibling,
+  const vector<unique_ptr<Histogram>>& partials) const {
+
+  if (parent != NULL && parent->hists[fid] && sibling->hists[fid]) {
+    const Histogram& parentHist = *(parent->hists[fid]);
+    unique_ptr<Histogram> hist = newHistogram(parentHist.num, 0, 0.0);
+    hist->setDifference(parentHist, *(sibling->hists[fid]));
+    return hist;
+  }
+
+  const auto& f = features_[fid];
+  unique_ptr<Histogram> hist = newHistogram(f.transitions.size() + 1,
+                                            split.size(), split.totalSum);
+  if (partials.empty()) {
+    buildHistogram(f, index_.data() + split.begin, index_.data() + split.end,
+                   *hist);
+  } else {
+    // reduce the partial histograms of the row blocks
+    for (const auto& partial : partials) {
+      hist->add(*partial);
+    }
+  }
+  if (f.encoding == SPARSE) {
+    hist->fillDefaultBin(f.defaultBin);
+  }
+  return hist;
+}
+
+// Number of row blocks to split a scan of numExamples on numFeatures
+// features into: feature-parallel (a single block) if there are enough
+// features to keep all threads busy, otherwise row-parallel or mixed, with
+// enough (feature, block) pairs for every thread, as long as the blocks stay
+// large enough to be worth a partial histogram of their own
+static int getNumBlocks(int numExamples, int numFeatures) {
+  const int numWorkers = Concurrency::getNumWorkers();
+  if (numFeatures == 0 || numFeatures >= numWorkers) {
+    return 1;
+  }
+  const int numBlocks = (numWorkers + numFeatures - 1) / numFeatures;
+  return std::max(1, std::min(numBlocks,
+                              numExamples / FLAGS_min_block_examples));
+}
 
+int TreeRegressor::splitExamples(const SplitNode& split) {
+
+  const auto start = chrono::steady_clock::now();
   const int fid = split.fid;
   const uint16_t fv = split.fv;
 
-  auto &f = ds_.features_[fid];
+  auto &f = features_[fid];
+
+  int* begin = index_.data() + split.begin;
+  int* end = index_.data() + split.end;
+  int* mid;
 
-  if (f.encoding == BYTE) {
-    boosting::split<uint8_t>(*(split.subset), left, right, *(f.bvec), fv);
+  if (f.encoding == SPARSE) {
+    mid = boosting::split(begin, end, buffer_.data(), SparseBins(f), fv);
+  } else if (f.encoding == NIBBLE) {
+    mid = boosting::split(begin, end, buffer_.data(), NibbleBins(f.bbins), fv);
+  } else if (f.encoding == BYTE) {
+    mid = boosting::split(begin, end, buffer_.data(), f.bbins, fv);
   } else {
     CHECK(f.encoding == SHORT);
-    boosting::split<uint16_t>(*(split.subset), left, right, *(f.svec), fv);
+    mid = boosting::split(begin, end, buffer_.data(), f.sbins, fv);
   }
+  partitionSec_ += chrono::duration<double>(
+    chrono::steady_clock::now() - start).count();
+  return mid - index_.data();
 }
 
 void TreeRegressor::getBestSplitFromHistogram(
@@ -193,61 +517,843 @@ void TreeRegressor::getBestSplitFromHistogram(
   *gain = bestGain;
 }
 
+vector<bool> TreeRegressor::sampleFeatures(double featureSamplingRate,
+                                           int splitIdx) const {
+  // with one sampling per tree, every split takes the one of the root
+  const int node = FLAGS_sample_features_per_tree ? 0 : splitIdx;
+  vector<bool> sampled(ds_.numFeatures_, false);
+  for (int fid = 0; fid < ds_.numFeatures_; fid++) {
+    if (ds_.features_[fid].encoding != EMPTY
+        && biasedCoinFlip(featureSamplingRate, FLAGS_seed, treeId_,
+                          node, fid)) {
+      sampled[fid] = true;
+    }
+  }
+  return sampled;
+}
+
+const vector<int>& TreeRegressor::sampleRows(double exampleSamplingRate) {
+  sampleExamples(exampleSamplingRate);
+  return index_;
+}
+
+void TreeRegressor::buildFeatureHistogram(int fid,
+                                          const int* begin,
+                                          const int* end,
+                                          Histogram& hist) const {
+  buildHistogram(features_[fid], begin, end, hist);
+}
+
+void TreeRegressor::sampleExamples(double exampleSamplingRate) {
+  // Every draw only depends on the example id, so chunks are sampled in
+  // parallel twice: first to count, then to fill in their part of index_
+  const int numExamples = ds_.getNumExamples();
+  const int numChunks =
+    (numExamples + SAMPLING_CHUNK_SIZE - 1) / SAMPLING_CHUNK_SIZE;
+  vector<int> offsets(numChunks + 1, 0);
+
+  Concurrency::parallelFor(
+    0, numExamples, SAMPLING_CHUNK_SIZE, [&](int begin, int end) {
+      int cnt = 0;
+      for (int i = begin; i < end; i++) {
+        cnt += biasedCoinFlip(exampleSamplingRate, FLAGS_seed, treeId_,
+                              EXAMPLE_SAMPLING, i);
+      }
+      offsets[begin / SAMPLING_CHUNK_SIZE + 1] = cnt;
+    });
+
+  for (int c = 0; c < numChunks; c++) {
+    offsets[c + 1] += offsets[c];
+  }
+  index_.resize(offsets[numChunks]);
+
+  Concurrency::parallelFor(
+    0, numExamples, SAMPLING_CHUNK_SIZE, [&](int begin, int end) {
+      int* out = index_.data() + offsets[begin / SAMPLING_CHUNK_SIZE];
+      for (int i = begin; i < end; i++) {
+        if (biasedCoinFlip(exampleSamplingRate, FLAGS_seed, treeId_,
+                           EXAMPLE_SAMPLING, i)) {
+          *out++ = i;
+        }
+      }
+    });
+}
+
+// *v, allocated the first time only, so that the buffers of compact rows
+// are reused from tree to tree
+template<class T>
+static vector<T>& reuse(unique_ptr<vector<T>>& v) {
+  if (!v) {
+    v.reset(new vector<T>());
+  }
+  return *v;
+}
+
+void TreeRegressor::gatherRows() {
+  rows_.swap(index_);
+  const int numRows = rows_.size();
+  index_.resize(numRows);
+  if (rowYf_ != NULL) {
+    compactYf_.resize(numRows);
+  } else {
+    compactY_.resize(numRows);
+  }
+  Concurrency::parallelFor(
+    0, numRows, SAMPLING_CHUNK_SIZE, [this](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        index_[i] = i;
+        if (rowYf_ != NULL) {
+          compactYf_[i] = rowYf_[rows_[i]];
+        } else {
+          compactY_[i] = rowY_[rows_[i]];
+        }
+      }
+    });
+
+  // one task per feature, then one per group
+  const int numFeatures = ds_.numFeatures_;
+  compactFeatures_.resize(numFeatures);
+  compactGroups_.resize(ds_.groups_.size());
+  Concurrency::parallelFor(
+    0, numFeatures + compactGroups_.size(), 1, [&](int begin, int end) {
+      for (int t = begin; t < end; t++) {
+        if (t >= numFeatures) {
+          const FeatureGroup& group = ds_.groups_[t - numFeatures];
+          FeatureGroup& compact = compactGroups_[t - numFeatures];
+          const int width = group.size();
+          compact.fids = group.fids;
+          compact.bins.resize(static_cast<size_t>(numRows) * width);
+          for (int i = 0; i < numRows; i++) {
+            std::copy_n(group.bins.data()
+                        + static_cast<size_t>(rows_[i]) * width,
+                        width,
+                        compact.bins.data() + static_cast<size_t>(i) * width);
+          }
+          continue;
+        }
+
+        const FeatureData& f = ds_.features_[t];
+        FeatureData& compact = compactFeatures_[t];
+        compact.transitions = f.transitions;
+        compact.encoding = f.encoding;
+        if (f.encoding == NIBBLE) {
+          const NibbleBins bins(f.bbins);
+          reuse(compact.bvec).assign(getNibbleBytes(numRows), 0);
+          uint8_t* out = compact.bvec->data();
+          for (int i = 0; i < numRows; i++) {
+            out[i >> 1] |= bins[rows_[i]] << ((i & 1) << 2);
+          }
+          compact.bbins = out;
+        } else if (f.encoding == BYTE) {
+          reuse(compact.bvec).resize(numRows);
+          for (int i = 0; i < numRows; i++) {
+            (*compact.bvec)[i] = f.bbins[rows_[i]];
+          }
+          compact.bbins = compact.bvec->data();
+        } else if (f.encoding == SHORT) {
+          reuse(compact.svec).resize(numRows);
+          for (int i = 0; i < numRows; i++) {
+            (*compact.svec)[i] = f.sbins[rows_[i]];
+          }
+          compact.sbins = compact.svec->data();
+        } else if (f.encoding == SPARSE) {
+          // both id lists are sorted, so the rows stay sorted as well
+          reuse(compact.ivec).clear();
+          reuse(compact.svec).clear();
+          const int* idsEnd = f.sids + f.numSparse;
+          const int* pos = f.sids;
+          for (int i = 0; i < numRows; i++) {
+            pos = gallop(pos, idsEnd, rows_[i]);
+            if (pos == idsEnd) {
+              break;
+            }
+            if (*pos == rows_[i]) {
+              compact.ivec->push_back(i);
+              compact.svec->push_back(f.sbins[pos - f.sids]);
+            }
+          }
+          compact.sids = compact.ivec->data();
+          compact.sbins = compact.svec->data();
+          compact.numSparse = compact.ivec->size();
+          compact.defaultBin = f.defaultBin;
+        }
+      }
+    });
+
+  features_ = compactFeatures_.data();
+  groups_ = &compactGroups_;
+  if (rowYf_ != NULL) {
+    rowYf_ = compactYf_.data();
+  } else {
+    rowY_ = compactY_.data();
+  }
+}
+
+TreeRegressor::SplitNode* TreeRegressor::newSplit(
+  int begin,
+  int end,
+  const SplitNode* parent,
+  const SplitNode* sibling) {
+
+  SplitNode* split = newNode(begin, end);
+
+  // sum of all target values
+  if (parent != NULL) {
+    split->totalSum = parent->totalSum - sibling->totalSum;
+    split->globalCnt = parent->globalCnt - sibling->globalCnt;
+    split->globalSum = parent->globalSum - sibling->globalSum;
+  } else {
+    for (int i = begin; i < end; i++) {
+      split->totalSum += (rowYf_ != NULL)
+        ? rowYf_[index_[i]] : rowY_[index_[i]];
+    }
+    split->globalSum = split->totalSum;
+    if (Comm::getSize() > 1) {
+      double totals[] = {split->totalSum, static_cast<double>(split->size())};
+      Comm::allreduceSum(totals, 2);
+      split->globalSum = totals[0];
+      split->globalCnt = totals[1];
+    }
+  }
+  return split;
+}
+
+bool TreeRegressor::isLeftSmaller(const SplitNode& split, int mid) const {
+  int left = mid - split.begin;
+  if (Comm::getSize() == 1) {
+    return left <= split.end - mid;
+  }
+  Comm::allreduceSum(&left, 1);
+  return left <= split.globalCnt - left;
+}
+
 TreeRegressor::SplitNode*
-TreeRegressor::getBestSplit(const vector<int>* subset,
-                            double featureSamplingRate,
+TreeRegressor::getBestSplit(int begin,
+                            int end,
+                            const vector<bool>& sampled,
+                            const SplitNode* parent,
+                            const SplitNode* sibling,
                             bool terminal) {
 
-  SplitNode* split = new SplitNode(subset);
   if (terminal) {
-    allSplits_.push_back(split);
-    return split;
+    return newNode(begin, end);
   }
 
-  int bestFid = -1;       // which feature to split on, -1 is invalid
-  int bestFv = 0;         // critical value of that feature
+  SplitNode* split = newSplit(begin, end, parent, sibling);
+  findBestSplits({split}, {&sampled}, {parent}, {sibling});
+  return split;
+}
 
-  // gain in prediction accuracy from that split:
-  // initialize to 0 instead of std::numeric_limits<double>::lowest() because,
-  // if no split results in a positive gain, we would rather report that, than
-  // return a valid but degenerate split
-  double bestGain = 0.0;
+void TreeRegressor::findBestSplits(
+  const vector<SplitNode*>& splits,
+  const vector<const vector<bool>*>& sampled,
+  const vector<const SplitNode*>& parents,
+  const vector<const SplitNode*>& siblings) {
+
+  ScopedTimer timer("split_search_sec");
+  const int numSplits = splits.size();
+
+  // For each of the sampled features, see if splitting on that feature
+  // results in the biggest improvement so far.
+  // gain in prediction accuracy from the best split is initialized to 0
+  // instead of std::numeric_limits<double>::lowest() because, if no split
+  // results in a positive gain, we would rather report that, than return a
+  // valid but degenerate split
+
+  // Sampled features, the ones with the most buckets (the most expensive to
+  // evaluate) first, so that they don't end up last in the work queue.
+  // Those that cannot be derived by subtraction need a scan of the
+  // examples; if there are too few of them to go around, the scan is split
+  // into row blocks first, and each block is built by its own task. In large
+  // nodes, features with row major bins are scanned a group at a time.
+  auto& fids = scratch_.fids;
+  auto& scanFids = scratch_.scanFids;
+  auto& groupFids = scratch_.groupFids;
+  auto& scanGroups = scratch_.scanGroups;
+  resetEach(&fids, numSplits);
+  resetEach(&scanFids, numSplits);
+  resetEach(&scanGroups, numSplits);
+  groupFids.resize(numSplits);
+  int numScanFids = 0;
+  int numScanGroups = 0;
+  double numScannedRows = 0.0;  // summed over the features scanned
+  int numDerived = 0;
+  for (int s = 0; s < numSplits; s++) {
+    const SplitNode* parent = parents[s];
+    const SplitNode* sibling = siblings[s];
+    const bool useGroups = (splits[s]->size() >= FLAGS_min_group_examples);
+    splits[s]->hists.resize(ds_.numFeatures_);
+    resetEach(&groupFids[s], ds_.groups_.size());
+
+    for (int fid = 0; fid < ds_.numFeatures_; fid++) {
+      if ((*sampled[s])[fid]) {
+        fids[s].push_back(fid);
+      }
+    }
+    stable_sort(fids[s].begin(), fids[s].end(), [this](int x, int y) {
+        return ds_.features_[x].transitions.size()
+          > ds_.features_[y].transitions.size();
+      });
+    for (int fid : fids[s]) {
+      if (parent != NULL && parent->hists[fid] && sibling->hists[fid]) {
+        numDerived++;
+        continue;
+      }
+      numScannedRows += splits[s]->size();
+      const int g = ds_.groupIds_[fid];
+      if (useGroups && g >= 0) {
+        if (groupFids[s][g].empty()) {
+          scanGroups[s].push_back(g);
+        }
+        groupFids[s][g].push_back(fid);
+      } else {
+        scanFids[s].push_back(fid);
+      }
+    }
+    numScanFids += scanFids[s].size();
+    numScanGroups += scanGroups[s].size();
+  }
+  Stats::add("histogram_rows", numScannedRows);
+  Stats::add("histograms_derived", numDerived);
+  Stats::add("nodes_evaluated", numSplits);
+
+  // The scans of all the nodes go out as a single parallel round. Single
+  // features that aren't split into row blocks are built while evaluating.
+  auto& partials = scratch_.partials;
+  auto& tasks = scratch_.tasks;
+  partials.resize(numSplits);
+  tasks.clear();
+  for (int s = 0; s < numSplits; s++) {
+    partials[s].resize(ds_.numFeatures_);
+
+    const int groupBlocks = getNumBlocks(splits[s]->size(), numScanGroups);
+    for (int g : scanGroups[s]) {
+      for (int fid : groupFids[s][g]) {
+        partials[s][fid].resize(groupBlocks);
+      }
+      for (int block = 0; block < groupBlocks; block++) {
+        tasks.push_back(ScanTask{s, -1, g, block, groupBlocks});
+      }
+    }
 
-  double totalSum = 0.0;  // sum of all target values
+    const int numBlocks = getNumBlocks(splits[s]->size(), numScanFids);
+    if (numBlocks > 1) {
+      for (int fid : scanFids[s]) {
+        partials[s][fid].resize(numBlocks);
+        for (int block = 0; block < numBlocks; block++) {
+          tasks.push_back(ScanTask{s, fid, -1, block, numBlocks});
+        }
+      }
+    }
+  }
+
+  // each worker scans the features on its NUMA node first
+  auto& order = scratch_.taskOrder;
+  auto& offsets = scratch_.taskOffsets;
+  Concurrency::groupByNode(
+    tasks.size(), [&](int t) { return getTaskNode(tasks[t]); },
+    &order, &offsets);
+  Concurrency::parallelForByNode(order, offsets, [&](int t) {
+      const ScanTask& task = tasks[t];
+      const SplitNode* split = splits[task.node];
+      const long size = split->size();
+      const int* begin = index_.data() + split->begin
+        + size * task.block / task.numBlocks;
+      const int* end = index_.data() + split->begin
+        + size * (task.block + 1) / task.numBlocks;
+      auto& nodePartials = partials[task.node];
+
+      if (task.group >= 0) {
+        const auto& members = groupFids[task.node][task.group];
+        auto& hists = scratch_.groupHists[Concurrency::getWorkerId()];
+        hists.clear();
+        for (int fid : members) {
+          const auto& f = features_[fid];
+          nodePartials[fid][task.block] =
+            newHistogram(f.transitions.size() + 1, end - begin, 0.0);
+          hists.push_back(nodePartials[fid][task.block].get());
+        }
+        buildGroupHistograms((*groups_)[task.group], members, begin, end,
+                             hists);
+      } else {
+        const auto& f = features_[task.fid];
+        auto& hist = nodePartials[task.fid][task.block];
+        hist = newHistogram(f.transitions.size() + 1, end - begin, 0.0);
+        buildHistogram(f, begin, end, *hist);
+      }
+    });
+
+  // Every worker keeps the best split of each node among the features it
+  // evaluated. With several ranks, the histograms built here only cover
+  // the local rows: all of them are finished first, summed over the ranks,
+  // and evaluated after that.
+  const bool distributed = (Comm::getSize() > 1);
+  auto& evals = scratch_.evals;
+  auto& built = scratch_.built;
+  evals.clear();
+  built.clear();
+  for (int s = 0; s < numSplits; s++) {
+    for (int fid : fids[s]) {
+      evals.emplace_back(s, fid);
+      if (parents[s] == NULL || !parents[s]->hists[fid]
+          || !siblings[s]->hists[fid]) {
+        built.emplace_back(s, fid);
+      }
+    }
+  }
+  auto& states = scratch_.states;
+  states.resize(Concurrency::getNumWorkers());
+  for (auto& workerStates : states) {
+    workerStates.assign(numSplits, SplitState());
+  }
+  auto evaluate = [&](int s, int fid) {
+    int fv;
+    double gain;
+    getBestSplitFromHistogram(*splits[s]->hists[fid], &fv, &gain);
+    states[Concurrency::getWorkerId()][s].update(fid, fv, gain);
+  };
+  // the features that aren't split into row blocks are scanned here
+  Concurrency::groupByNode(
+    evals.size(), [&](int i) { return ds_.getFeatureNode(evals[i].second); },
+    &order, &offsets);
+  Concurrency::parallelForByNode(order, offsets, [&](int i) {
+      const int s = evals[i].first;
+      const int fid = evals[i].second;
+      splits[s]->hists[fid] = getHistogram(*splits[s], fid, parents[s],
+                                           siblings[s], partials[s][fid]);
+      if (!distributed) {
+        evaluate(s, fid);
+      }
+    });
+  if (distributed) {
+    allreduceHistograms(splits, built);
+    Concurrency::parallelFor(0, evals.size(), 1, [&](int b, int e) {
+        for (int i = b; i < e; i++) {
+          evaluate(evals[i].first, evals[i].second);
+        }
+      });
+  }
+
+  for (int s = 0; s < numSplits; s++) {
+    SplitNode* split = splits[s];
+    SplitState best;
+    for (const auto& workerStates : states) {
+      const SplitState& state = workerStates[s];
+      best.update(state.fid, state.fv, state.gain);
+    }
+    if (best.gain > 0.0) {
+      split->fid = best.fid;
+      split->fv = best.fv;
+      split->gain = best.gain;
+    }
 
-  for (auto& id : *subset) {
-    totalSum += y_[id];
+    for (const auto& hist : split->hists) {
+      if (hist) {
+        cachedHistBytes_ += hist->getBytes();
+      }
+    }
+
+    frontiers_.push_back(split);
   }
 
-  // For each of a random sampling of features, see if splitting on that
-  // feature results in the biggest improvement so far.
-  // TODO(tiankai): The various fid's can be processed in parallel.
-  CounterMonitor monitor(FLAGS_num_threads);
-  boost::scoped_array<ParallelBestSplit::ParallelSplitState> splitStates(
-          new ParallelBestSplit::ParallelSplitState[FLAGS_num_threads]);
+  for (int s = 0; s < numSplits; s++) {
+    for (auto& featurePartials : partials[s]) {
+      recycle(&featurePartials);
+    }
+  }
+}
 
-  
-  for (int wid = 0; wid < FLAGS_num_threads; wid++) {
-      Concurrency::threadManager->add(
-              boost::shared_ptr<apache::thrift::concurrency::Runnable>(
-                  new ParallelBestSplit(
-                      monitor, *this, splitStates[wid], wid, FLAGS_num_threads, 
-                      totalSum, subset, featureSamplingRate, ds_)));
+void TreeRegressor::findLevelSplits(
+  const vector<SplitNode*>& smallers,
+  const vector<SplitNode*>& largers,
+  const vector<const SplitNode*>& parents,
+  const vector<vector<bool>>& sampled) {
+
+  ScopedTimer timer("split_search_sec");
+  const int numPairs = smallers.size();
+
+  // features sampled by any of the pairs, the most expensive to evaluate
+  // first (as in findBestSplits)
+  resetEach(&scratch_.fids, 1);
+  auto& fids = scratch_.fids[0];
+  for (int fid = 0; fid < ds_.numFeatures_; fid++) {
+    for (int p = 0; p < numPairs; p++) {
+      if (sampled[p][fid]) {
+        fids.push_back(fid);
+        break;
+      }
+    }
   }
-  monitor.wait();
-  for (int wid = 0; wid < FLAGS_num_threads; wid++) {
-      if (splitStates[wid].bestGain > split->gain) {
-          split->fid = splitStates[wid].bestFid;
-          split->fv = splitStates[wid].bestFv;
-          split->gain = splitStates[wid].bestGain;
+  stable_sort(fids.begin(), fids.end(), [this](int x, int y) {
+      return ds_.features_[x].transitions.size()
+        > ds_.features_[y].transitions.size();
+    });
+
+  // All the children, smallers first, and the ones to scan, by slot. A
+  // child is scanned for the features its pair sampled, except the ones a
+  // larger child derives from its parent (which the smaller sibling always
+  // has); fidSlots[fid] are the slots scanned for fid.
+  auto& splits = scratch_.splits;
+  auto& scans = scratch_.scans;
+  auto& slots = scratch_.slots;
+  auto& fidSlots = scratch_.fidSlots;
+  splits.assign(smallers.begin(), smallers.end());
+  splits.insert(splits.end(), largers.begin(), largers.end());
+  scans.clear();
+  slots.assign(2 * numPairs, -1);
+  resetEach(&fidSlots, ds_.numFeatures_);
+  int numDerived = 0;
+  double numHistogramRows = 0.0;  // summed over the features scanned
+  for (int s = 0; s < 2 * numPairs; s++) {
+    splits[s]->hists.resize(ds_.numFeatures_);
+    const vector<bool>& pairSampled = sampled[s % numPairs];
+    const SplitNode* parent = parents[s % numPairs];
+    for (int fid : fids) {
+      if (!pairSampled[fid]) {
+        continue;
+      }
+      if (s >= numPairs && parent != NULL && parent->hists[fid]) {
+        numDerived++;
+        continue;
       }
+      if (slots[s] < 0) {
+        slots[s] = scans.size();
+        scans.push_back(splits[s]);
+      }
+      fidSlots[fid].push_back(slots[s]);
+      numHistogramRows += splits[s]->size();
+    }
+  }
+  const int numScans = scans.size();
+
+  // node id of every position in index_ that is scanned
+  auto& nodeIds = scratch_.nodeIds;
+  nodeIds.assign(index_.size(), -1);
+  int numScannedRows = 0;
+  for (int slot = 0; slot < numScans; slot++) {
+    std::fill(nodeIds.begin() + scans[slot]->begin,
+              nodeIds.begin() + scans[slot]->end, slot);
+    numScannedRows += scans[slot]->size();
+  }
+  Stats::add("histogram_rows", numHistogramRows);
+  Stats::add("histograms_derived", numDerived);
+  Stats::add("nodes_evaluated", 2 * numPairs);
+
+  // One task per feature, or group of features with row major bins, and
+  // row block of index_, building the histograms of all the nodes scanned
+  // for it at once; hists[fid][block * numScans + slot] is the one of a
+  // slot, NULL if that slot isn't scanned for fid.
+  const bool useGroups = (numScannedRows >= FLAGS_min_group_examples);
+  resetEach(&scratch_.scanFids, 1);
+  resetEach(&scratch_.scanGroups, 1);
+  scratch_.groupFids.resize(1);
+  resetEach(&scratch_.groupFids[0], ds_.groups_.size());
+  auto& scanFids = scratch_.scanFids[0];
+  auto& groupFids = scratch_.groupFids[0];
+  auto& scanGroups = scratch_.scanGroups[0];
+  for (int fid : fids) {
+    if (fidSlots[fid].empty()) {
+      continue;
+    }
+    const int g = ds_.groupIds_[fid];
+    if (useGroups && g >= 0) {
+      if (groupFids[g].empty()) {
+        scanGroups.push_back(g);
+      }
+      groupFids[g].push_back(fid);
+    } else {
+      scanFids.push_back(fid);
+    }
+  }
+  // Every feature, and group, only goes through the ranges of index_ of
+  // the slots it is scanned for, merged where they are adjacent: its runs,
+  // runs[fid] (or runs[numFeatures_ + g]) and the number of rows in them,
+  // which its blocks split evenly
+  auto& runs = scratch_.runs;
+  auto& runRows = scratch_.runRows;
+  auto& runSlots = scratch_.runSlots;
+  resetEach(&runs, ds_.numFeatures_ + ds_.groups_.size());
+  runRows.assign(runs.size(), 0);
+  long maxRunRows = 0;
+  auto setRuns = [&](int unit) {
+    sort(runSlots.begin(), runSlots.end(), [&scans](int x, int y) {
+        return scans[x]->begin < scans[y]->begin;
+      });
+    auto& unitRuns = runs[unit];
+    for (int slot : runSlots) {
+      const SplitNode& scan = *scans[slot];
+      if (!unitRuns.empty() && unitRuns.back().second == scan.begin) {
+        unitRuns.back().second = scan.end;
+      } else {
+        unitRuns.emplace_back(scan.begin, scan.end);
+      }
+      runRows[unit] += scan.size();
+    }
+    maxRunRows = std::max(maxRunRows, runRows[unit]);
+  };
+  for (int g : scanGroups) {
+    runSlots.clear();
+    for (int fid : groupFids[g]) {
+      runSlots.insert(runSlots.end(), fidSlots[fid].begin(),
+                      fidSlots[fid].end());
+    }
+    sort(runSlots.begin(), runSlots.end());
+    runSlots.erase(unique(runSlots.begin(), runSlots.end()),
+                   runSlots.end());
+    setRuns(ds_.numFeatures_ + g);
+  }
+  for (int fid : scanFids) {
+    runSlots.assign(fidSlots[fid].begin(), fidSlots[fid].end());
+    setRuns(fid);
   }
 
-  frontiers_.push_back(split);
-  allSplits_.push_back(split);
-  return split;
+  const int numBlocks = getNumBlocks(maxRunRows,
+                                     scanGroups.size() + scanFids.size());
+  scratch_.partials.resize(1);
+  auto& hists = scratch_.partials[0];
+  auto& tasks = scratch_.tasks;
+  hists.resize(ds_.numFeatures_);
+  tasks.clear();
+  for (int g : scanGroups) {
+    for (int block = 0; block < numBlocks; block++) {
+      tasks.push_back(ScanTask{-1, -1, g, block, numBlocks});
+    }
+  }
+  for (int fid : scanFids) {
+    for (int block = 0; block < numBlocks; block++) {
+      tasks.push_back(ScanTask{-1, fid, -1, block, numBlocks});
+    }
+  }
+  for (int fid : fids) {
+    hists[fid].resize(numBlocks * numScans);
+  }
+
+  auto& order = scratch_.taskOrder;
+  auto& offsets = scratch_.taskOffsets;
+  Concurrency::groupByNode(
+    tasks.size(), [&](int t) { return getTaskNode(tasks[t]); },
+    &order, &offsets);
+  Concurrency::parallelForByNode(order, offsets, [&](int t) {
+      const ScanTask& task = tasks[t];
+      const int unit = task.group >= 0
+        ? ds_.numFeatures_ + task.group : task.fid;
+      const int base = task.block * numScans;
+
+      // calls build(begin, end) for the pieces of the runs of unit that
+      // make up the rows [first, last) of them
+      const long first = runRows[unit] * task.block / task.numBlocks;
+      const long last = runRows[unit] * (task.block + 1) / task.numBlocks;
+      auto forEachPiece = [&](const function<void(int, int)>& build) {
+        long offset = 0;
+        for (const auto& run : runs[unit]) {
+          const long size = run.second - run.first;
+          const long b = std::max(first, offset);
+          const long e = std::min(last, offset + size);
+          if (b < e) {
+            build(run.first + (b - offset), run.first + (e - offset));
+          }
+          offset += size;
+        }
+      };
+
+      if (task.group >= 0) {
+        const auto& members = groupFids[task.group];
+        for (int fid : members) {
+          const int num = features_[fid].transitions.size() + 1;
+          for (int slot : fidSlots[fid]) {
+            hists[fid][base + slot] = newHistogram(num, 0, 0.0);
+          }
+        }
+        forEachPiece([&](int begin, int end) {
+            buildLevelGroupHistograms((*groups_)[task.group], members,
+                                      begin, end, hists, base);
+          });
+      } else {
+        const int num = features_[task.fid].transitions.size() + 1;
+        for (int slot : fidSlots[task.fid]) {
+          hists[task.fid][base + slot] = newHistogram(num, 0, 0.0);
+        }
+        forEachPiece([&](int begin, int end) {
+            buildLevelHistograms(features_[task.fid], begin, end, scans,
+                                 hists[task.fid].data() + base);
+          });
+      }
+    });
+
+  // Histogram of fid of split s: the one of its slot (reduced over the
+  // blocks, which may take it), or derived from the parent and the smaller
+  // sibling
+  auto isScanned = [&](int s, int fid) {
+    return slots[s] >= 0 && hists[fid][slots[s]];
+  };
+  auto finish = [&](int s, int fid) {
+    const SplitNode& split = *splits[s];
+    const int slot = slots[s];
+    auto& partials = hists[fid];
+    unique_ptr<Histogram> hist;
+    if (!isScanned(s, fid)) {
+      const Histogram& parentHist = *(parents[s % numPairs]->hists[fid]);
+      hist = newHistogram(parentHist.num, 0, 0.0);
+      hist->setDifference(parentHist, *(splits[s - numPairs]->hists[fid]));
+      return hist;
+    }
+    if (numBlocks == 1) {
+      hist = std::move(partials[slot]);
+      hist->totalCnt = split.size();
+      hist->totalSum = split.totalSum;
+    } else {
+      hist = newHistogram(partials[slot]->num, split.size(), split.totalSum);
+      for (int block = 0; block < numBlocks; block++) {
+        hist->add(*partials[block * numScans + slot]);
+      }
+    }
+    if (features_[fid].encoding == SPARSE) {
+      hist->fillDefaultBin(features_[fid].defaultBin);
+    }
+    return hist;
+  };
+
+  // Every (pair of children, feature it sampled) is finished and evaluated
+  // by one task, the smaller child first since the larger may be derived
+  // from it. With several ranks, the scanned histograms are summed over
+  // the ranks before deriving and evaluating any.
+  const bool distributed = (Comm::getSize() > 1);
+  auto& states = scratch_.states;
+  states.resize(Concurrency::getNumWorkers());
+  for (auto& workerStates : states) {
+    workerStates.assign(2 * numPairs, SplitState());
+  }
+  auto evaluate = [&](int s, int fid) {
+    int fv;
+    double gain;
+    getBestSplitFromHistogram(*splits[s]->hists[fid], &fv, &gain);
+    states[Concurrency::getWorkerId()][s].update(fid, fv, gain);
+  };
+  auto& evals = scratch_.evals;
+  evals.clear();
+  for (int p = 0; p < numPairs; p++) {
+    for (int fid : fids) {
+      if (sampled[p][fid]) {
+        evals.emplace_back(p, fid);
+      }
+    }
+  }
+  if (distributed) {
+    auto& built = scratch_.built;
+    built.clear();
+    for (int s = 0; s < 2 * numPairs; s++) {
+      for (int fid : fids) {
+        if (isScanned(s, fid)) {
+          built.emplace_back(s, fid);
+        }
+      }
+    }
+    Concurrency::parallelFor(0, built.size(), 1, [&](int b, int e) {
+        for (int i = b; i < e; i++) {
+          const int s = built[i].first;
+          const int fid = built[i].second;
+          splits[s]->hists[fid] = finish(s, fid);
+        }
+      });
+    allreduceHistograms(splits, built);
+  }
+  Concurrency::parallelFor(0, evals.size(), 1, [&](int b, int e) {
+      for (int i = b; i < e; i++) {
+        const int smaller = evals[i].first;
+        const int fid = evals[i].second;
+        for (int s : {smaller, numPairs + smaller}) {
+          if (!splits[s]->hists[fid]) {
+            splits[s]->hists[fid] = finish(s, fid);
+          }
+          evaluate(s, fid);
+        }
+      }
+    });
+
+  for (int s = 0; s < 2 * numPairs; s++) {
+    SplitNode* split = splits[s];
+    SplitState best;
+    for (const auto& workerStates : states) {
+      const SplitState& state = workerStates[s];
+      best.update(state.fid, state.fv, state.gain);
+    }
+    if (best.gain > 0.0) {
+      split->fid = best.fid;
+      split->fv = best.fv;
+      split->gain = best.gain;
+    }
+
+    for (const auto& hist : split->hists) {
+      if (hist) {
+        cachedHistBytes_ += hist->getBytes();
+      }
+    }
+
+    frontiers_.push_back(split);
+  }
+
+  for (auto& partials : hists) {
+    recycle(&partials);
+  }
 }
 
+void TreeRegressor::allreduceHistograms(
+  const vector<SplitNode*>& splits,
+  const vector<pair<int, int>>& built) {
+
+  // all of them in one message
+  size_t size = 0;
+  for (const auto& hist : built) {
+    size += splits[hist.first]->hists[hist.second]->num;
+  }
+  vector<int> cnt(size);
+  vector<double> sumy(size);
+  size_t pos = 0;
+  for (const auto& h : built) {
+    const Histogram& hist = *splits[h.first]->hists[h.second];
+    copy(hist.cnt.begin(), hist.cnt.end(), cnt.begin() + pos);
+    copy(hist.sumy.begin(), hist.sumy.end(), sumy.begin() + pos);
+    pos += hist.num;
+  }
+
+  Comm::allreduceSum(cnt.data(), size);
+  Comm::allreduceSum(sumy.data(), size);
+
+  pos = 0;
+  for (const auto& h : built) {
+    const SplitNode& split = *splits[h.first];
+    Histogram& hist = *split.hists[h.second];
+    copy(cnt.begin() + pos, cnt.begin() + pos + hist.num, hist.cnt.begin());
+    copy(sumy.begin() + pos, sumy.begin() + pos + hist.num,
+         hist.sumy.begin());
+    hist.totalCnt = split.globalCnt;
+    hist.totalSum = split.globalSum;
+    pos += hist.num;
+  }
+}
+
+void TreeRegressor::trimHistogramCache() {
+  const size_t budget = static_cast<size_t>(FLAGS_histogram_cache_mb) << 20;
+
+  while (cachedHistBytes_ > budget) {
+    SplitNode* victim = NULL;
+    for (SplitNode* split : frontiers_) {
+      if (!split->hists.empty()
+          && (victim == NULL || split->gain < victim->gain)) {
+        victim = split;
+      }
+    }
+    if (victim == NULL) {
+      break;
+    }
+    for (const auto& hist : victim->hists) {
+      if (hist) {
+        cachedHistBytes_ -= hist->getBytes();
+      }
+    }
+    releaseHistograms(victim);
+  }
+}
 
 TreeNode<uint16_t>* TreeRegressor::getTree(
   const int numLeaves,
@@ -256,21 +1362,158 @@ TreeNode<uint16_t>* TreeRegressor::getTree(
   double fimps[]) {
 
   // randomly sample data in ds_
-  vector<int>* subset = new vector<int>();
-  for (int i = 0; i < ds_.getNumExamples(); i++) {
-    if (biasedCoinFlip(exampleSamplingRate)) {
-      subset->push_back(i);
+  {
+    ScopedTimer timer("sampling_sec");
+    sampleExamples(exampleSamplingRate);
+    CHECK(Comm::getSize() > 1
+          || index_.size() >= FLAGS_min_leaf_examples * numLeaves);
+    buffer_.resize(index_.size());
+    if (FLAGS_compact_rows) {
+      gatherRows();
     }
   }
-  CHECK(subset->size() >= FLAGS_min_leaf_examples * numLeaves);
+  Stats::add("sampled_rows", index_.size());
 
   // compute the decision tree in SplitNode's
-  SplitNode* root = getBestSplits(subset, numLeaves - 1, featureSamplingRate);
+  SplitNode* root = getBestSplits(numLeaves - 1, featureSamplingRate);
+  root_ = root;
+  Stats::add("partition_sec", partitionSec_);
 
   // convert the decision tree to PartitionNode's and LeafNode's
   return getTreeHelper(root, fimps);
 }
 
+void TreeRegressor::getLeafIndex(vector<int>* leaf) const {
+  CHECK(root_ != NULL);
+  const int numExamples = ds_.getNumExamples();
+  leaf->resize(numExamples);
+
+  Concurrency::parallelFor(0, numExamples, SAMPLING_CHUNK_SIZE,
+                           [leaf](int begin, int end) {
+      std::fill(leaf->begin() + begin, leaf->begin() + end, -1);
+    });
+  Concurrency::parallelFor(0, leaves_.size(), 1, [&](int begin, int end) {
+      for (int k = begin; k < end; k++) {
+        for (int i = leaves_[k]->begin; i < leaves_[k]->end; i++) {
+          (*leaf)[rows_.empty() ? index_[i] : rows_[index_[i]]] = k;
+        }
+      }
+    });
+
+  Concurrency::parallelFor(
+    0, numExamples, SAMPLING_CHUNK_SIZE, [&](int begin, int end) {
+      for (int eid = begin; eid < end; eid++) {
+        if ((*leaf)[eid] < 0) {
+          getLeafIndex(ds_, eid, eid + 1, leaf->data() + eid);
+        }
+      }
+    });
+}
+
+void TreeRegressor::getLeafIndex(const DataSet& ds, int begin, int end,
+                                 int* leaf) const {
+  CHECK(root_ != NULL);
+  for (int eid = begin; eid < end; eid++) {
+    const SplitNode* node = root_;
+    while (node->selected) {
+      node = (ds.getBucket(node->fid, eid) <= node->fv)
+        ? node->left : node->right;
+    }
+    leaf[eid - begin] = node->leafIdx;
+  }
+}
+
+TreeRegressor::SplitNode* TreeRegressor::getBestSplitsByLevel(
+  const int numSplits, double featureSamplingRate) {
+
+  SplitNode* firstSplit = getBestSplit(
+    0, index_.size(), sampleFeatures(featureSamplingRate, 0),
+    NULL, NULL, false);
+  trimHistogramCache();
+
+  // the children of the last splits stay leaves: no feature to evaluate
+  const vector<bool> none;
+  int numSelected = 0;
+  while (numSelected < numSplits) {
+    // The frontier nodes with a gain are the ones of the current level.
+    // Split all of them, the ones with the most gain first if there are
+    // more of them than splits left.
+    vector<SplitNode*> level;
+    for (SplitNode* split : frontiers_) {
+      if (split->gain > 0.0) {
+        level.push_back(split);
+      }
+    }
+    if (level.empty()) {
+      break;
+    }
+    stable_sort(level.begin(), level.end(),
+                [](const SplitNode* x, const SplitNode* y) {
+                  return x->gain > y->gain;
+                });
+    const int numLeft = numSplits - numSelected;
+    if (static_cast<int>(level.size()) > numLeft) {
+      level.resize(numLeft);
+    }
+    const bool terminal = (static_cast<int>(level.size()) == numLeft);
+
+    // Partition the examples of every node, then find the best splits of
+    // all the children together, both children of a node on the sampling
+    // of features drawn for its split
+    const int numNodes = level.size();
+    vector<vector<bool>> sampled(numNodes);
+    vector<SplitNode*> smallers(numNodes);
+    vector<SplitNode*> largers(numNodes);
+    vector<const SplitNode*> parents(numNodes);
+    vector<bool> leftSmaller(numNodes);
+    for (int i = 0; i < numNodes; i++) {
+      SplitNode* split = level[i];
+      split->selected = true;
+      numSelected++;
+      frontiers_.erase(find(frontiers_.begin(), frontiers_.end(), split));
+
+      const int mid = splitExamples(*split);
+      leftSmaller[i] = isLeftSmaller(*split, mid);
+      const int smallBegin = leftSmaller[i] ? split->begin : mid;
+      const int smallEnd = leftSmaller[i] ? mid : split->end;
+      const int largeBegin = leftSmaller[i] ? mid : split->begin;
+      const int largeEnd = leftSmaller[i] ? split->end : mid;
+
+      if (terminal) {
+        smallers[i] = getBestSplit(smallBegin, smallEnd, none,
+                                   NULL, NULL, true);
+        largers[i] = getBestSplit(largeBegin, largeEnd, none,
+                                  NULL, NULL, true);
+      } else {
+        sampled[i] = sampleFeatures(featureSamplingRate, numSelected);
+        smallers[i] = newSplit(smallBegin, smallEnd, NULL, NULL);
+        parents[i] = split->hists.empty() ? NULL : split;
+        largers[i] = newSplit(largeBegin, largeEnd, parents[i], smallers[i]);
+      }
+    }
+
+    if (!terminal) {
+      findLevelSplits(smallers, largers, parents, sampled);
+    }
+
+    for (int i = 0; i < numNodes; i++) {
+      SplitNode* split = level[i];
+      split->left = leftSmaller[i] ? smallers[i] : largers[i];
+      split->right = leftSmaller[i] ? largers[i] : smallers[i];
+
+      for (const auto& hist : split->hists) {
+        if (hist) {
+          cachedHistBytes_ -= hist->getBytes();
+        }
+      }
+      releaseHistograms(split);
+    }
+    trimHistogramCache();
+  }
+
+  return firstSplit;
+}
+
 TreeNode<uint16_t>* TreeRegressor::getTreeHelper(
   SplitNode* split,
   double fimps[]) {
@@ -279,18 +1522,46 @@ TreeNode<uint16_t>* TreeRegressor::getTreeHelper(
     return NULL;
   } else if (!split->selected) {
     // leaf of decision tree
-    double fvote = fun_.getLeafVal(*(split->subset), y_);
+    const int* begin = index_.data() + split->begin;
+    const int* end = index_.data() + split->end;
+    if (!rows_.empty()) {
+      auto& ids = scratch_.leafRows;
+      ids.resize(split->size());
+      for (int i = 0; i < split->size(); i++) {
+        ids[i] = rows_[index_[split->begin + i]];
+      }
+      begin = ids.data();
+      end = ids.data() + ids.size();
+    }
+    double fvote = 0.0;
+    int numExamples = split->size();
+    if (Comm::getSize() > 1) {
+      // from the statistics of the examples of all the ranks (some of
+      // which may have none in the leaf), followed by their number
+      auto& stats = scratch_.leafStats;
+      stats.assign(fun_.getNumStats() + 1, 0.0);
+      fun_.addLeafStats(begin, end, y_, stats.data());
+      stats.back() = numExamples;
+      Comm::allreduceSum(stats.data(), stats.size());
+      fvote = fun_.getLeafValFromStats(stats.data());
+      numExamples = stats.back();
+    } else {
+      fvote = fun_.getLeafVal(begin, end, y_);
+    }
+    split->leafIdx = leaves_.size();
+    leaves_.push_back(split);
+    leafVotes_.push_back(fvote);
     LOG(INFO) << "leaf:  " << fvote << ", #examples:"
-              << split->subset->size();
-    CHECK(split->subset->size() >= FLAGS_min_leaf_examples);
+              << numExamples;
+    CHECK(numExamples >= FLAGS_min_leaf_examples);
 
     return new LeafNode<uint16_t>(fvote);
   } else {
     // internal node of decision tree
     LOG(INFO) << "select split: " << split->fid << ":" << split->fv
               << " gain: " << split->gain << ", #examples:"
-              << split->subset->size() << ", min partition: "
-              << std::min(split->left->subset->size(), split->right->subset->size());
+              << split->size() << ", min partition: "
+              << std::min(split->left->size(), split->right->size());
 
     fimps[split->fid] += split->gain;
 
@@ -303,12 +1574,17 @@ TreeNode<uint16_t>* TreeRegressor::getTreeHelper(
 }
 
 TreeRegressor::SplitNode* TreeRegressor::getBestSplits(
-  const vector<int>* subset, const int numSplits, double featureSamplingRate) {
+  const int numSplits, double featureSamplingRate) {
 
-  CHECK(subset != NULL);
+  if (FLAGS_level_wise) {
+    return getBestSplitsByLevel(numSplits, featureSamplingRate);
+  }
 
   // Compute the root of the decision tree.
-  SplitNode* firstSplit = getBestSplit(subset, featureSamplingRate, false);
+  SplitNode* firstSplit = getBestSplit(
+    0, index_.size(), sampleFeatures(featureSamplingRate, 0),
+    NULL, NULL, false);
+  trimHistogramCache();
 
   int numSelected = 0;
   do {
@@ -339,14 +1615,36 @@ TreeRegressor::SplitNode* TreeRegressor::getBestSplits(
     frontiers_.erase(best_it);
 
     // Now that we've selected bestSplit, expand its left and right children.
-    vector<int>* left = new vector<int>();
-    vector<int>* right = new vector<int>();
-
-    splitExamples(*bestSplit, left, right);
+    const int mid = splitExamples(*bestSplit);
     bool terminal = (numSelected == numSplits);
 
-    bestSplit->left = getBestSplit(left, featureSamplingRate, terminal);
-    bestSplit->right = getBestSplit(right, featureSamplingRate, terminal);
+    // Scan only the smaller child, and derive the histograms of the larger
+    // one from those of bestSplit, for the features that bestSplit was
+    // evaluated on too (and still has cached), scanning the others. Both
+    // children share the same sampling of features, so that the smaller
+    // one has every histogram the larger may be derived from.
+    const vector<bool> sampled = terminal
+      ? vector<bool>() : sampleFeatures(featureSamplingRate, numSelected);
+    const bool leftSmaller = isLeftSmaller(*bestSplit, mid);
+
+    SplitNode* smaller = leftSmaller
+      ? getBestSplit(bestSplit->begin, mid, sampled, NULL, NULL, terminal)
+      : getBestSplit(mid, bestSplit->end, sampled, NULL, NULL, terminal);
+    const SplitNode* parent = bestSplit->hists.empty() ? NULL : bestSplit;
+    SplitNode* larger = leftSmaller
+      ? getBestSplit(mid, bestSplit->end, sampled, parent, smaller, terminal)
+      : getBestSplit(bestSplit->begin, mid, sampled, parent, smaller, terminal);
+
+    bestSplit->left = leftSmaller ? smaller : larger;
+    bestSplit->right = leftSmaller ? larger : smaller;
+
+    for (const auto& hist : bestSplit->hists) {
+      if (hist) {
+        cachedHistBytes_ -= hist->getBytes();
+      }
+    }
+    releaseHistograms(bestSplit);
+    trimHistogramCache();
   } while (numSelected < numSplits);
 
   return firstSplit;